@@ -7,6 +7,7 @@
  * Released under the GPLv2 only.
  */
 
+#include <linux/rcupdate.h>
 #include <linux/workqueue.h>
 
 #include "greybus.h"
@@ -31,21 +32,18 @@ gb_connection_intf_find(struct gb_interface *intf, u16 cport_id)
 	return NULL;
 }
 
+/*
+ * Look up the connection using a host device CPort.  The caller must hold
+ * rcu_read_lock(), which keeps the connection from being destroyed until
+ * it is released.
+ */
 static struct gb_connection *
 gb_connection_hd_find(struct greybus_host_device *hd, u16 cport_id)
 {
-	struct gb_connection *connection;
-	unsigned long flags;
-
-	spin_lock_irqsave(&gb_connections_lock, flags);
-	list_for_each_entry(connection, &hd->connections, hd_links)
-		if (connection->hd_cport_id == cport_id)
-			goto found;
-	connection = NULL;
-found:
-	spin_unlock_irqrestore(&gb_connections_lock, flags);
+	if (cport_id >= hd->num_cports)
+		return NULL;
 
-	return connection;
+	return rcu_dereference(hd->cport_connections[cport_id]);
 }
 
 /*
@@ -57,16 +55,55 @@ void greybus_data_rcvd(struct greybus_host_device *hd, u16 cport_id,
 {
 	struct gb_connection *connection;
 
+	rcu_read_lock();
 	connection = gb_connection_hd_find(hd, cport_id);
 	if (!connection) {
+		rcu_read_unlock();
 		dev_err(hd->parent,
 			"nonexistent connection (%zu bytes dropped)\n", length);
 		return;
 	}
 	gb_connection_recv(connection, data, length);
+	rcu_read_unlock();
 }
 EXPORT_SYMBOL_GPL(greybus_data_rcvd);
 
+/*
+ * Like greybus_data_rcvd(), but offers the core ownership of the receive
+ * buffer, which must be hd->buffer_size_max bytes in size, so that it can
+ * be used as the message buffer without copying the data.
+ *
+ * Returns true if the buffer has been adopted, in which case the host
+ * driver must not touch it again until it is handed back through the
+ * buffer_free callback.  Otherwise the data has been consumed (or
+ * dropped) and the buffer can be reused immediately.
+ */
+bool greybus_data_rcvd_loan(struct greybus_host_device *hd, u16 cport_id,
+			    u8 *data, size_t length)
+{
+	struct gb_connection *connection;
+	bool adopted;
+
+	if (WARN_ON_ONCE(!hd->driver->buffer_free)) {
+		greybus_data_rcvd(hd, cport_id, data, length);
+		return false;
+	}
+
+	rcu_read_lock();
+	connection = gb_connection_hd_find(hd, cport_id);
+	if (!connection) {
+		rcu_read_unlock();
+		dev_err(hd->parent,
+			"nonexistent connection (%zu bytes dropped)\n", length);
+		return false;
+	}
+	adopted = gb_connection_recv_loan(connection, data, length);
+	rcu_read_unlock();
+
+	return adopted;
+}
+EXPORT_SYMBOL_GPL(greybus_data_rcvd_loan);
+
 static ssize_t state_show(struct device *dev, struct device_attribute *attr,
 			  char *buf)
 {
@@ -101,20 +138,195 @@ ap_cport_id_show(struct device *dev, struct device_attribute *attr, char *buf)
 }
 static DEVICE_ATTR_RO(ap_cport_id);
 
+static ssize_t
+window_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct gb_connection *connection = to_gb_connection(dev);
+
+	return sprintf(buf, "%u\n", connection->window);
+}
+
+static ssize_t window_store(struct device *dev, struct device_attribute *attr,
+			    const char *buf, size_t size)
+{
+	struct gb_connection *connection = to_gb_connection(dev);
+	unsigned int window;
+	int ret;
+
+	ret = kstrtouint(buf, 0, &window);
+	if (ret)
+		return ret;
+
+	spin_lock_irq(&connection->lock);
+	connection->window = window;
+	spin_unlock_irq(&connection->lock);
+
+	/* The window may have grown, let blocked senders retry */
+	wake_up_all(&connection->window_wq);
+
+	return size;
+}
+static DEVICE_ATTR_RW(window);
+
+static ssize_t
+in_flight_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct gb_connection *connection = to_gb_connection(dev);
+	unsigned int in_flight;
+
+	spin_lock_irq(&connection->lock);
+	in_flight = connection->in_flight;
+	spin_unlock_irq(&connection->lock);
+
+	return sprintf(buf, "%u\n", in_flight);
+}
+static DEVICE_ATTR_RO(in_flight);
+
+static ssize_t
+timeout_min_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct gb_connection *connection = to_gb_connection(dev);
+
+	return sprintf(buf, "%u\n", connection->timeout_min);
+}
+
+static ssize_t timeout_min_store(struct device *dev,
+				 struct device_attribute *attr,
+				 const char *buf, size_t size)
+{
+	struct gb_connection *connection = to_gb_connection(dev);
+	unsigned int timeout;
+	int ret;
+
+	ret = kstrtouint(buf, 0, &timeout);
+	if (ret)
+		return ret;
+
+	spin_lock_irq(&connection->lock);
+	if (timeout > connection->timeout_max)
+		ret = -EINVAL;
+	else
+		connection->timeout_min = timeout;
+	spin_unlock_irq(&connection->lock);
+
+	return ret ? ret : size;
+}
+static DEVICE_ATTR_RW(timeout_min);
+
+static ssize_t
+timeout_max_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct gb_connection *connection = to_gb_connection(dev);
+
+	return sprintf(buf, "%u\n", connection->timeout_max);
+}
+
+static ssize_t timeout_max_store(struct device *dev,
+				 struct device_attribute *attr,
+				 const char *buf, size_t size)
+{
+	struct gb_connection *connection = to_gb_connection(dev);
+	unsigned int timeout;
+	int ret;
+
+	ret = kstrtouint(buf, 0, &timeout);
+	if (ret)
+		return ret;
+
+	spin_lock_irq(&connection->lock);
+	if (!timeout || timeout < connection->timeout_min)
+		ret = -EINVAL;
+	else
+		connection->timeout_max = timeout;
+	spin_unlock_irq(&connection->lock);
+
+	return ret ? ret : size;
+}
+static DEVICE_ATTR_RW(timeout_max);
+
 static struct attribute *connection_attrs[] = {
 	&dev_attr_state.attr,
 	&dev_attr_protocol_id.attr,
 	&dev_attr_ap_cport_id.attr,
+	&dev_attr_window.attr,
+	&dev_attr_in_flight.attr,
+	&dev_attr_timeout_min.attr,
+	&dev_attr_timeout_max.attr,
 	NULL,
 };
 
-ATTRIBUTE_GROUPS(connection);
+static const struct attribute_group connection_group = {
+	.attrs = connection_attrs,
+};
+
+static u64 gb_connection_stats_read(struct gb_connection *connection,
+				    size_t offset)
+{
+	u64 sum = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		sum += *(u64 *)((void *)per_cpu_ptr(connection->stats, cpu) +
+				offset);
+
+	return sum;
+}
+
+#define gb_connection_stats_attr(field)					\
+static ssize_t field##_show(struct device *dev,				\
+			    struct device_attribute *attr, char *buf)	\
+{									\
+	struct gb_connection *connection = to_gb_connection(dev);	\
+									\
+	return sprintf(buf, "%llu\n", gb_connection_stats_read(connection, \
+			offsetof(struct gb_connection_stats, field)));	\
+}									\
+static DEVICE_ATTR_RO(field)
+
+gb_connection_stats_attr(tx_messages);
+gb_connection_stats_attr(tx_bytes);
+gb_connection_stats_attr(tx_errors);
+gb_connection_stats_attr(rx_messages);
+gb_connection_stats_attr(rx_bytes);
+gb_connection_stats_attr(rx_dropped);
+gb_connection_stats_attr(responses);
+gb_connection_stats_attr(responses_unmatched);
+gb_connection_stats_attr(timeouts);
+gb_connection_stats_attr(cancellations);
+
+static struct attribute *connection_stats_attrs[] = {
+	&dev_attr_tx_messages.attr,
+	&dev_attr_tx_bytes.attr,
+	&dev_attr_tx_errors.attr,
+	&dev_attr_rx_messages.attr,
+	&dev_attr_rx_bytes.attr,
+	&dev_attr_rx_dropped.attr,
+	&dev_attr_responses.attr,
+	&dev_attr_responses_unmatched.attr,
+	&dev_attr_timeouts.attr,
+	&dev_attr_cancellations.attr,
+	NULL,
+};
+
+static const struct attribute_group connection_stats_group = {
+	.name = "statistics",
+	.attrs = connection_stats_attrs,
+};
+
+static const struct attribute_group *connection_groups[] = {
+	&connection_group,
+	&connection_stats_group,
+	NULL,
+};
 
 static void gb_connection_release(struct device *dev)
 {
 	struct gb_connection *connection = to_gb_connection(dev);
 
-	destroy_workqueue(connection->wq);
+	flush_work(&connection->request_work);
+	gb_operation_request_pool_destroy(connection);
+	free_percpu(connection->stats);
+	free_percpu(connection->latency);
 	kfree(connection);
 }
 
@@ -204,12 +416,25 @@ gb_connection_create_range(struct greybus_host_device *hd,
 	atomic_set(&connection->op_cycle, 0);
 	spin_lock_init(&connection->lock);
 	INIT_LIST_HEAD(&connection->operations);
-
-	connection->wq = alloc_workqueue("%s:%d", WQ_UNBOUND, 1,
-					 dev_name(parent), cport_id);
-	if (!connection->wq)
+	hash_init(connection->outgoing_operations);
+	INIT_LIST_HEAD(&connection->partial_requests);
+	connection->message_size_max = hd->buffer_size_max;
+	connection->window = GB_CONNECTION_WINDOW_DEFAULT;
+	init_waitqueue_head(&connection->window_wq);
+	connection->timeout_min = GB_OPERATION_TIMEOUT_MIN_DEFAULT;
+	connection->timeout_max = GB_OPERATION_TIMEOUT_MAX_DEFAULT;
+
+	INIT_LIST_HEAD(&connection->request_queue);
+	INIT_WORK(&connection->request_work, gb_operation_request_work);
+
+	connection->latency = alloc_percpu(struct gb_operation_latency);
+	if (!connection->latency)
 		goto err_free_connection;
 
+	connection->stats = alloc_percpu(struct gb_connection_stats);
+	if (!connection->stats)
+		goto err_free_latency;
+
 	connection->dev.parent = parent;
 	connection->dev.bus = &greybus_bus_type;
 	connection->dev.type = &greybus_connection_type;
@@ -237,8 +462,12 @@ gb_connection_create_range(struct greybus_host_device *hd,
 	else
 		INIT_LIST_HEAD(&connection->bundle_links);
 
+	rcu_assign_pointer(hd->cport_connections[hd_cport_id], connection);
+
 	spin_unlock_irq(&gb_connections_lock);
 
+	gb_debugfs_cport_create(connection, 0);
+
 	gb_connection_bind_protocol(connection);
 	if (!connection->protocol)
 		dev_warn(&connection->dev,
@@ -246,6 +475,8 @@ gb_connection_create_range(struct greybus_host_device *hd,
 
 	return connection;
 
+err_free_latency:
+	free_percpu(connection->latency);
 err_free_connection:
 	kfree(connection);
 err_remove_ida:
@@ -404,6 +635,44 @@ gb_connection_control_disconnected(struct gb_connection *connection)
 	}
 }
 
+/*
+ * Negotiate message fragmentation for protocols that want to exchange
+ * messages larger than what the host device can transfer.  Fragmentation
+ * is simply not used if the interface does not support it.
+ */
+static void
+gb_connection_fragmentation_negotiate(struct gb_connection *connection)
+{
+	struct gb_protocol *protocol = connection->protocol;
+	struct gb_control *control;
+	int ret;
+
+	connection->message_size_max = connection->hd->buffer_size_max;
+
+	if (!(protocol->flags & GB_PROTOCOL_FRAGMENTATION) ||
+	    protocol->flags & GB_PROTOCOL_SKIP_CONTROL_CONNECTED)
+		return;
+
+	control = connection->bundle->intf->control;
+
+	ret = gb_control_fragmentation_operation(control,
+					connection->intf_cport_id,
+					GB_OPERATION_MESSAGE_SIZE_MAX);
+	if (ret == -EOPNOTSUPP) {
+		dev_dbg(&connection->dev, "message fragmentation not supported\n");
+		return;
+	}
+	if (ret < 0) {
+		dev_warn(&connection->dev,
+				"failed to negotiate message fragmentation: %d\n",
+				ret);
+		return;
+	}
+
+	if (ret > connection->message_size_max)
+		connection->message_size_max = ret;
+}
+
 /*
  * Request protocol version supported by the module. We don't need to do
  * this for SVC as that is initiated by the SVC.
@@ -431,6 +700,13 @@ static int gb_connection_init(struct gb_connection *connection)
 	struct gb_protocol *protocol = connection->protocol;
 	int ret;
 
+	ret = gb_operation_request_pool_create(connection);
+	if (ret) {
+		dev_err(&connection->dev,
+				"failed to create request pool: %d\n", ret);
+		return ret;
+	}
+
 	ret = gb_connection_hd_cport_enable(connection);
 	if (ret)
 		return ret;
@@ -443,6 +719,8 @@ static int gb_connection_init(struct gb_connection *connection)
 	if (ret)
 		goto err_svc_destroy;
 
+	gb_connection_fragmentation_negotiate(connection);
+
 	/* Need to enable the connection to initialize it */
 	spin_lock_irq(&connection->lock);
 	connection->state = GB_CONNECTION_STATE_ENABLED;
@@ -485,7 +763,11 @@ static void gb_connection_exit(struct gb_connection *connection)
 	connection->state = GB_CONNECTION_STATE_DESTROYING;
 	spin_unlock_irq(&connection->lock);
 
+	/* Senders waiting for the window to open will now fail */
+	wake_up_all(&connection->window_wq);
+
 	gb_connection_cancel_operations(connection, -ESHUTDOWN);
+	gb_operation_partial_requests_discard(connection);
 
 	connection->protocol->connection_exit(connection);
 	gb_connection_control_disconnected(connection);
@@ -508,8 +790,15 @@ void gb_connection_destroy(struct gb_connection *connection)
 	spin_lock_irq(&gb_connections_lock);
 	list_del(&connection->bundle_links);
 	list_del(&connection->hd_links);
+	RCU_INIT_POINTER(connection->hd->cport_connections[connection->hd_cport_id],
+			 NULL);
 	spin_unlock_irq(&gb_connections_lock);
 
+	/* Wait for the receive path to be done with the connection */
+	synchronize_rcu();
+
+	gb_debugfs_cport_destroy(connection);
+
 	if (connection->protocol)
 		gb_protocol_put(connection->protocol);
 	connection->protocol = NULL;
@@ -12,6 +12,35 @@
 
 #include <linux/list.h>
 #include <linux/kfifo.h>
+#include <linux/hashtable.h>
+#include <linux/mempool.h>
+#include <linux/percpu.h>
+#include <linux/wait.h>
+
+/* Outgoing operations are hashed by id for response lookup */
+#define GB_CONNECTION_OPERATIONS_HASH_BITS	6
+
+/* Default number of outgoing requests in flight (0 means no limit) */
+#define GB_CONNECTION_WINDOW_DEFAULT		16
+
+/* Traffic and error counters, maintained per CPU */
+struct gb_connection_stats {
+	u64	tx_messages;
+	u64	tx_bytes;
+	u64	tx_errors;
+	u64	rx_messages;
+	u64	rx_bytes;
+	u64	rx_dropped;
+	u64	responses;
+	u64	responses_unmatched;
+	u64	timeouts;
+	u64	cancellations;
+};
+
+#define gb_connection_stats_inc(connection, field) \
+	this_cpu_inc((connection)->stats->field)
+#define gb_connection_stats_add(connection, field, val) \
+	this_cpu_add((connection)->stats->field, val)
 
 enum gb_connection_state {
 	GB_CONNECTION_STATE_INVALID	= 0,
@@ -38,16 +67,39 @@ struct gb_connection {
 	u8				module_major;
 	u8				module_minor;
 
+	/* Largest message, including fragmented ones, we can exchange */
+	size_t				message_size_max;
+
 	spinlock_t			lock;
 	enum gb_connection_state	state;
 	struct list_head		operations;
+	DECLARE_HASHTABLE(outgoing_operations,
+			  GB_CONNECTION_OPERATIONS_HASH_BITS);
+	struct list_head		partial_requests;
+	unsigned int			partial_request_count;
+
+	unsigned int			window;
+	unsigned int			in_flight;
+	wait_queue_head_t		window_wq;
+
+	/* Bounds of adaptive response timeouts, in milliseconds */
+	unsigned int			timeout_min;
+	unsigned int			timeout_max;
 
-	struct workqueue_struct		*wq;
+	mempool_t			*request_pool;
+	struct gb_operation		*nomem_operation;
+
+	/* Incoming requests, handled in order by request_work */
+	struct list_head		request_queue;
+	struct work_struct		request_work;
 
 	atomic_t			op_cycle;
 
 	void				*private;
 
+	struct gb_operation_latency __percpu *latency;
+	struct gb_connection_stats __percpu *stats;
+
 	struct dentry			*dentry;
 };
 #define to_gb_connection(d) container_of(d, struct gb_connection, dev)
@@ -65,6 +117,8 @@ void gb_hd_connections_exit(struct greybus_host_device *hd);
 
 void greybus_data_rcvd(struct greybus_host_device *hd, u16 cport_id,
 			u8 *data, size_t length);
+bool greybus_data_rcvd_loan(struct greybus_host_device *hd, u16 cport_id,
+			    u8 *data, size_t length);
 
 int gb_connection_bind_protocol(struct gb_connection *connection);
 
@@ -60,6 +60,47 @@ int gb_control_disconnected_operation(struct gb_control *control, u16 cport_id)
 				 sizeof(request), NULL, 0);
 }
 
+/*
+ * Negotiate message fragmentation for a CPort.  @size_max is the size of
+ * the largest (reassembled) message we can handle.  Returns the size of the
+ * largest message both ends can handle, -EOPNOTSUPP if the interface does
+ * not implement the operation, or another negative errno on failure.
+ *
+ * Many interfaces predate this operation, so failures are left to the
+ * caller to report.
+ */
+int gb_control_fragmentation_operation(struct gb_control *control, u16 cport_id,
+				       u16 size_max)
+{
+	struct gb_control_fragmentation_request *request;
+	struct gb_control_fragmentation_response *response;
+	struct gb_operation *operation;
+	int ret;
+
+	operation = gb_operation_create(control->connection,
+					GB_CONTROL_TYPE_FRAGMENTATION,
+					sizeof(*request), sizeof(*response),
+					GFP_KERNEL);
+	if (!operation)
+		return -ENOMEM;
+
+	request = operation->request->payload;
+	request->cport_id = cpu_to_le16(cport_id);
+	request->size_max = cpu_to_le16(size_max);
+
+	ret = gb_operation_request_send_sync(operation);
+	if (ret == -EPROTONOSUPPORT)
+		ret = -EOPNOTSUPP;
+	if (!ret) {
+		response = operation->response->payload;
+		ret = min_t(u16, size_max, le16_to_cpu(response->size_max));
+	}
+
+	gb_operation_put(operation);
+
+	return ret;
+}
+
 static int gb_control_request_recv(u8 type, struct gb_operation *op)
 {
 	struct gb_connection *connection = op->connection;
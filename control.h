@@ -16,6 +16,8 @@ struct gb_control {
 
 int gb_control_connected_operation(struct gb_control *control, u16 cport_id);
 int gb_control_disconnected_operation(struct gb_control *control, u16 cport_id);
+int gb_control_fragmentation_operation(struct gb_control *control, u16 cport_id,
+				       u16 size_max);
 int gb_control_get_manifest_size_operation(struct gb_interface *intf);
 int gb_control_get_manifest_operation(struct gb_interface *intf, void *manifest,
 				      size_t size);
@@ -160,17 +160,35 @@ EXPORT_SYMBOL_GPL(greybus_deregister_driver);
 
 static DEFINE_MUTEX(hd_mutex);
 
-static void free_hd(struct kref *kref)
+static void free_hd_work(struct work_struct *work)
 {
 	struct greybus_host_device *hd;
 
-	hd = container_of(kref, struct greybus_host_device, kref);
+	hd = container_of(work, struct greybus_host_device, release_work);
 
+	mutex_lock(&hd_mutex);
+	if (hd->driver->hd_release)
+		hd->driver->hd_release(hd);
+	gb_debugfs_hd_destroy(hd);
 	ida_destroy(&hd->cport_id_map);
+	kfree(hd->cport_connections);
 	kfree(hd);
 	mutex_unlock(&hd_mutex);
 }
 
+/*
+ * The last reference may be dropped in atomic context along with a message
+ * buffer, so the host device is freed from a work item.
+ */
+static void free_hd(struct kref *kref)
+{
+	struct greybus_host_device *hd;
+
+	hd = container_of(kref, struct greybus_host_device, kref);
+
+	schedule_work(&hd->release_work);
+}
+
 struct greybus_host_device *greybus_create_hd(struct greybus_host_driver *driver,
 					      struct device *parent,
 					      size_t buffer_size_max,
@@ -187,6 +205,11 @@ struct greybus_host_device *greybus_create_hd(struct greybus_host_driver *driver
 		return ERR_PTR(-EINVAL);
 	}
 
+	if (!driver->message_buffer_alloc != !driver->message_buffer_free) {
+		pr_err("message buffer callbacks must be implemented together\n");
+		return ERR_PTR(-EINVAL);
+	}
+
 	if (buffer_size_max < GB_OPERATION_MESSAGE_SIZE_MIN) {
 		dev_err(parent, "greybus host-device buffers too small\n");
 		return ERR_PTR(-EINVAL);
@@ -211,7 +234,16 @@ struct greybus_host_device *greybus_create_hd(struct greybus_host_driver *driver
 	if (!hd)
 		return ERR_PTR(-ENOMEM);
 
+	hd->cport_connections = kcalloc(num_cports,
+					sizeof(*hd->cport_connections),
+					GFP_KERNEL);
+	if (!hd->cport_connections) {
+		kfree(hd);
+		return ERR_PTR(-ENOMEM);
+	}
+
 	kref_init(&hd->kref);
+	INIT_WORK(&hd->release_work, free_hd_work);
 	hd->parent = parent;
 	hd->driver = driver;
 	INIT_LIST_HEAD(&hd->interfaces);
@@ -220,6 +252,8 @@ struct greybus_host_device *greybus_create_hd(struct greybus_host_driver *driver
 	hd->buffer_size_max = buffer_size_max;
 	hd->num_cports = num_cports;
 
+	gb_debugfs_hd_create(hd);
+
 	/*
 	 * Initialize AP's SVC protocol connection:
 	 *
@@ -231,7 +265,7 @@ struct greybus_host_device *greybus_create_hd(struct greybus_host_driver *driver
 	 * endo-id and AP's interface id for that.
 	 */
 	if (!gb_ap_svc_connection_create(hd)) {
-		kref_put_mutex(&hd->kref, free_hd, &hd_mutex);
+		gb_hd_put(hd);
 		return ERR_PTR(-ENOMEM);
 	}
 
@@ -273,10 +307,26 @@ void greybus_remove_hd(struct greybus_host_device *hd)
 	if (WARN_ON(!list_empty(&hd->connections)))
 		gb_hd_connections_exit(hd);
 
-	kref_put_mutex(&hd->kref, free_hd, &hd_mutex);
+	gb_hd_put(hd);
 }
 EXPORT_SYMBOL_GPL(greybus_remove_hd);
 
+/*
+ * Keep a host device (and its driver's private data) around after it has
+ * been removed, for as long as something it handed out is still in use.
+ */
+void gb_hd_get(struct greybus_host_device *hd)
+{
+	kref_get(&hd->kref);
+}
+EXPORT_SYMBOL_GPL(gb_hd_get);
+
+void gb_hd_put(struct greybus_host_device *hd)
+{
+	kref_put(&hd->kref, free_hd);
+}
+EXPORT_SYMBOL_GPL(gb_hd_put);
+
 static int __init gb_init(void)
 {
 	int retval;
@@ -350,6 +400,7 @@ static void __exit gb_exit(void)
 	gb_control_protocol_exit();
 	gb_endo_exit();
 	gb_operation_exit();
+	flush_scheduled_work();		/* pending free_hd_work() */
 	bus_unregister(&greybus_bus_type);
 	gb_debugfs_cleanup();
 	tracepoint_synchronize_unregister();
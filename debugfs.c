@@ -10,11 +10,218 @@
 #define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
 
 #include <linux/debugfs.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/mutex.h>
+#include <linux/rcupdate.h>
+#include <linux/seq_file.h>
 
 #include "greybus.h"
 
 static struct dentry *gb_debug_root;
 
+/* Host devices, for the oldest operation gauge */
+static LIST_HEAD(gb_debugfs_hds);
+static DEFINE_MUTEX(gb_debugfs_hds_mutex);
+
+static int latency_show(struct seq_file *s, void *unused)
+{
+	struct gb_connection *connection = s->private;
+	struct gb_operation_latency *latency;
+	u32 buckets[GB_OPERATION_LATENCY_BUCKETS];
+	u32 max;
+	u64 count;
+	int type;
+	int cpu;
+	int i;
+
+	for (type = 0; type < GB_OPERATION_LATENCY_TYPES; type++) {
+		memset(buckets, 0, sizeof(buckets));
+		count = 0;
+		max = 0;
+
+		for_each_possible_cpu(cpu) {
+			latency = per_cpu_ptr(connection->latency, cpu);
+			for (i = 0; i < GB_OPERATION_LATENCY_BUCKETS; i++) {
+				buckets[i] += latency->buckets[type][i];
+				count += latency->buckets[type][i];
+			}
+			max = max_t(u32, max, latency->max[type]);
+		}
+
+		if (!count)
+			continue;
+
+		seq_printf(s, "type 0x%02x%s: count %llu p50 %uus p99 %uus max %uus\n",
+			   type,
+			   type == GB_OPERATION_LATENCY_TYPES - 1 ? "+" : "",
+			   count, gb_operation_latency_percentile(buckets, count, 50),
+			   gb_operation_latency_percentile(buckets, count, 99), max);
+	}
+
+	return 0;
+}
+
+static int latency_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, latency_show, inode->i_private);
+}
+
+/* Writing anything resets the histograms */
+static ssize_t latency_write(struct file *file, const char __user *buf,
+			     size_t count, loff_t *ppos)
+{
+	struct seq_file *s = file->private_data;
+	struct gb_connection *connection = s->private;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		memset(per_cpu_ptr(connection->latency, cpu), 0,
+		       sizeof(struct gb_operation_latency));
+
+	return count;
+}
+
+static const struct file_operations latency_fops = {
+	.open		= latency_open,
+	.read		= seq_read,
+	.write		= latency_write,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+/*
+ * List the active operations of a connection.  Returns the age, in
+ * microseconds, of the oldest one, or 0 if there is none.
+ */
+static s64 gb_debugfs_operations_show(struct seq_file *s,
+				      struct gb_connection *connection,
+				      ktime_t now)
+{
+	struct gb_operation *operation;
+	s64 oldest = 0;
+	s64 age;
+
+	spin_lock_irq(&connection->lock);
+	list_for_each_entry(operation, &connection->operations, links) {
+		age = ktime_us_delta(now, operation->created);
+		oldest = max(oldest, age);
+
+		if (!s)
+			continue;
+
+		seq_printf(s, "%s %s op=%04x type=%02x flags=%lx active=%d waiters=%d errno=%d age=%lldus\n",
+			   dev_name(&connection->dev),
+			   gb_operation_is_incoming(operation) ? "in" : "out",
+			   operation->id, operation->type, operation->flags,
+			   operation->active,
+			   atomic_read(&operation->waiters),
+			   operation->errno, age);
+	}
+	spin_unlock_irq(&connection->lock);
+
+	return oldest;
+}
+
+static s64 gb_debugfs_hd_operations_show(struct seq_file *s,
+					 struct greybus_host_device *hd,
+					 ktime_t now)
+{
+	struct gb_connection *connection;
+	s64 oldest = 0;
+	u16 cport_id;
+
+	rcu_read_lock();
+	for (cport_id = 0; cport_id < hd->num_cports; cport_id++) {
+		connection = rcu_dereference(hd->cport_connections[cport_id]);
+		if (connection)
+			oldest = max(oldest, gb_debugfs_operations_show(s,
+							connection, now));
+	}
+	rcu_read_unlock();
+
+	return oldest;
+}
+
+static int operations_show(struct seq_file *s, void *unused)
+{
+	gb_debugfs_operations_show(s, s->private, ktime_get());
+
+	return 0;
+}
+
+static int operations_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, operations_show, inode->i_private);
+}
+
+static const struct file_operations operations_fops = {
+	.open		= operations_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static int hd_operations_show(struct seq_file *s, void *unused)
+{
+	gb_debugfs_hd_operations_show(s, s->private, ktime_get());
+
+	return 0;
+}
+
+static int hd_operations_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, hd_operations_show, inode->i_private);
+}
+
+static const struct file_operations hd_operations_fops = {
+	.open		= hd_operations_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+/* Age, in microseconds, of the oldest active operation of any host device */
+static int oldest_operation_get(void *data, u64 *val)
+{
+	struct greybus_host_device *hd;
+	ktime_t now = ktime_get();
+	s64 oldest = 0;
+
+	mutex_lock(&gb_debugfs_hds_mutex);
+	list_for_each_entry(hd, &gb_debugfs_hds, debugfs_links)
+		oldest = max(oldest,
+			     gb_debugfs_hd_operations_show(NULL, hd, now));
+	mutex_unlock(&gb_debugfs_hds_mutex);
+
+	*val = oldest;
+
+	return 0;
+}
+DEFINE_SIMPLE_ATTRIBUTE(oldest_operation_fops, oldest_operation_get, NULL,
+			"%llu\n");
+
+void gb_debugfs_hd_create(struct greybus_host_device *hd)
+{
+	hd->dentry = debugfs_create_dir(dev_name(hd->parent), gb_debug_root);
+	debugfs_create_file("operations", S_IRUGO, hd->dentry, hd,
+			    &hd_operations_fops);
+
+	mutex_lock(&gb_debugfs_hds_mutex);
+	list_add_tail(&hd->debugfs_links, &gb_debugfs_hds);
+	mutex_unlock(&gb_debugfs_hds_mutex);
+}
+
+void gb_debugfs_hd_destroy(struct greybus_host_device *hd)
+{
+	mutex_lock(&gb_debugfs_hds_mutex);
+	list_del(&hd->debugfs_links);
+	mutex_unlock(&gb_debugfs_hds_mutex);
+
+	debugfs_remove_recursive(hd->dentry);
+	hd->dentry = NULL;
+}
+
 struct dentry *gb_debugfs_cport_create(struct gb_connection *connection,
 					u8 intf_id)
 {
@@ -23,6 +230,12 @@ struct dentry *gb_debugfs_cport_create(struct gb_connection *connection,
 	if (connection->dentry == NULL) {
 		name = dev_name(&connection->dev);
 		connection->dentry = debugfs_create_dir(name, gb_debug_root);	
+		debugfs_create_file("latency", S_IRUGO | S_IWUSR,
+				    connection->dentry, connection,
+				    &latency_fops);
+		debugfs_create_file("operations", S_IRUGO,
+				    connection->dentry, connection,
+				    &operations_fops);
 	}
 
 	return connection->dentry;
@@ -33,12 +246,15 @@ void gb_debugfs_cport_destroy(struct gb_connection *connection)
 {
 	if (connection->dentry)
 		debugfs_remove_recursive(connection->dentry);
+	connection->dentry = NULL;
 }
 EXPORT_SYMBOL_GPL(gb_debugfs_cport_destroy);
 
 void __init gb_debugfs_init(void)
 {
 	gb_debug_root = debugfs_create_dir("greybus", NULL);
+	debugfs_create_file("oldest_operation_us", S_IRUGO, gb_debug_root,
+			    NULL, &oldest_operation_fops);
 }
 
 void gb_debugfs_cleanup(void)
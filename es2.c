@@ -6,11 +6,15 @@
  *
  * Released under the GPLv2 only.
  */
+#include <linux/hrtimer.h>
 #include <linux/kthread.h>
+#include <linux/mutex.h>
 #include <linux/sizes.h>
 #include <linux/usb.h>
 #include <linux/kfifo.h>
 #include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/workqueue.h>
 #include <asm/unaligned.h>
 
 #include "greybus.h"
@@ -44,16 +48,95 @@ static DEFINE_KFIFO(apb1_log_fifo, char, APB1_LOG_SIZE);
 #define MUXED_EP_OUT		2
 
 /*
- * Number of CPort IN urbs in flight at any point in time.
- * Adjust if we are having stalls in the USB buffer due to not enough urbs in
- * flight.
+ * Initial number of CPort IN urbs in flight for each bulk IN endpoint, and
+ * hard limit on it.  The pools grow when an endpoint runs out of submitted
+ * urbs, and shrink back when they stay idle, within the cport_in_urbs_min
+ * and cport_in_urbs_max module parameters.
  */
 #define NUM_CPORT_IN_URB	4
+#define NUM_CPORT_IN_URB_MAX	32
 
-/* Number of CPort OUT urbs in flight at any point in time.
- * Adjust if we get messages saying we are out of urbs in the system log.
+/*
+ * Initial number of pre-allocated CPort OUT urbs, and hard limit on it.  The
+ * pool grows when it is mostly in use or when urbs had to be dynamically
+ * allocated, and shrinks back when mostly idle, within the
+ * cport_out_urbs_min and cport_out_urbs_max module parameters.
  */
 #define NUM_CPORT_OUT_URB	(8 * NUM_BULKS)
+#define NUM_CPORT_OUT_URB_MAX	256
+
+/* Urb pool resizing period, and number of idle periods before shrinking */
+#define URB_POOL_PERIOD		msecs_to_jiffies(250)
+#define URB_POOL_IDLE_PERIODS	8
+
+static unsigned int cport_in_urbs_min = 2;
+module_param(cport_in_urbs_min, uint, 0444);
+static unsigned int cport_in_urbs_max = 16;
+module_param(cport_in_urbs_max, uint, 0444);
+static unsigned int cport_out_urbs_min = 2 * NUM_BULKS;
+module_param(cport_out_urbs_min, uint, 0444);
+static unsigned int cport_out_urbs_max = 4 * NUM_CPORT_OUT_URB;
+module_param(cport_out_urbs_max, uint, 0444);
+
+/*
+ * CPorts are moved to a dedicated endpoints pair when their traffic exceeds
+ * ep_map_hot_rate bytes per second, or ep_map_latency_rate for those whose
+ * protocol is latency sensitive, as long as endpoints pairs are free.  They
+ * are moved back to the muxed endpoints pair once they have stayed below
+ * half that rate for EP_MAP_IDLE_PERIODS.  Messages to a CPort being moved
+ * are held back until the messages already being sent have completed, for
+ * up to EP_MAP_DRAIN_TIMEOUT.
+ */
+#define EP_MAP_PERIOD		HZ
+#define EP_MAP_IDLE_PERIODS	5
+#define EP_MAP_DRAIN_TIMEOUT	msecs_to_jiffies(20)
+
+static bool ep_map_auto = true;
+module_param(ep_map_auto, bool, 0644);
+static unsigned int ep_map_hot_rate = 256 * 1024;
+module_param(ep_map_hot_rate, uint, 0644);
+static unsigned int ep_map_latency_rate = 8 * 1024;
+module_param(ep_map_latency_rate, uint, 0644);
+
+/*
+ * When APBridge supports it, messages of up to PACK_MESSAGE_SIZE_MAX bytes
+ * sent to the same bulk out endpoint within pack_window_us microseconds of
+ * each other are sent in a single transfer, of up to PACK_MESSAGES_MAX
+ * messages.  APBridge may then also send several messages per bulk in
+ * transfer.  The messages of a transfer are laid out back to back, each one
+ * starting PACK_ALIGN aligned.  Each bulk out endpoint has
+ * NUM_CPORT_OUT_PACKS such transfers pre-allocated; messages are sent on
+ * their own while they are all in use.  Packing delays small messages by up
+ * to the window, so it is off unless pack_window_us is set before the
+ * device is probed.
+ */
+#define PACK_ALIGN		8
+#define PACK_MESSAGE_SIZE_MAX	256
+#define PACK_MESSAGES_MAX	16
+#define NUM_CPORT_OUT_PACKS	4
+
+static unsigned int pack_window_us;
+module_param(pack_window_us, uint, 0644);
+
+/*
+ * Transfer buffers, used by bulk in transfers and packed bulk out ones, and
+ * the buffers of outbound messages of up to DMA_MESSAGE_BUFFER_SIZE bytes
+ * are taken from pools of coherent memory, which need no DMA mapping for
+ * each transfer.  They are kmalloc()ed when their pool is exhausted, or
+ * when its size is set to 0.
+ */
+#define DMA_MESSAGE_BUFFER_SIZE	256
+
+static unsigned int dma_transfer_buffers = 128;
+module_param(dma_transfer_buffers, uint, 0444);
+static unsigned int dma_message_buffers = 128;
+module_param(dma_message_buffers, uint, 0444);
+
+/*
+ * Number of spare buffers kept around to refill CPort IN urbs whose buffer
+ * has been handed over to the greybus core.
+ */
+#define NUM_CPORT_IN_BUFFER_SPARE	(NUM_CPORT_IN_URB * NUM_BULKS)
 
 /* vendor request APB1 log */
 #define REQUEST_LOG		0x02
@@ -64,6 +147,9 @@ static DEFINE_KFIFO(apb1_log_fifo, char, APB1_LOG_SIZE);
 /* vendor request to get the number of cports available */
 #define REQUEST_CPORT_COUNT	0x04
 
+/* vendor request to send and receive several messages per bulk transfer */
+#define REQUEST_PACKING		0x05
+
 /* convert the bulk out endpoint number to an endpoint pair number */
 #define bulk_out_to_ep_pair(ep)		\
 	((ep - MUXED_EP_OUT) >> 1)
@@ -77,20 +163,100 @@ static DEFINE_KFIFO(apb1_log_fifo, char, APB1_LOG_SIZE);
 
 /*
  * @endpoint: bulk in endpoint for CPort data
- * @urb: array of urbs for the CPort in messages
- * @buffer: array of buffers for the @cport_in_urb urbs
+ * @es1: the device the endpoint belongs to
+ * @anchor: the urbs currently submitted to the endpoint
+ * @urbs: number of urbs of the endpoint, submitted or being completed
+ * @queued: number of urbs submitted to the endpoint
+ * @target: number of urbs the endpoint should have, excess urbs are freed
+ *	    when they complete
+ * @starved: number of times the endpoint was left without submitted urbs
+ * @starved_seen: @starved when the pool was last resized
+ * @idle: number of pool resizes since the endpoint last starved
+ * @urbs_peak: largest number of urbs the endpoint had
+ *
+ * The buffer of each urb is loaned to the greybus core when a message is
+ * received, and replaced with a spare one before the urb is resubmitted.
  */
 struct es1_cport_in {
 	__u8 endpoint;
-	struct urb *urb[NUM_CPORT_IN_URB];
-	u8 *buffer[NUM_CPORT_IN_URB];
+	struct es1_ap_dev *es1;
+	struct usb_anchor anchor;
+	atomic_t urbs;
+	atomic_t queued;
+	unsigned int target;
+	atomic_t starved;
+	unsigned int starved_seen;
+	unsigned int idle;
+	unsigned int urbs_peak;
 };
 
+struct es1_cport_out_pack;
+
 /*
  * @endpoint: bulk out endpoint for CPort data
+ * @es1: the device the endpoint belongs to
+ * @pack_lock: locks @packing, @pack and @pack_free, and serializes the
+ *	       submission of packed transfers
+ * @packing: whether small messages are packed
+ * @pack: the packed transfer messages are being added to, if any
+ * @packs: the pre-allocated packed transfers
+ * @pack_free: the packed transfers not in use
+ * @pack_timer: submits @pack once the packing window is over
+ * @pack_anchor: the packed transfers submitted to the endpoint
  */
 struct es1_cport_out {
 	__u8 endpoint;
+	struct es1_ap_dev *es1;
+	spinlock_t pack_lock;
+	bool packing;
+	struct es1_cport_out_pack *pack;
+	struct es1_cport_out_pack *packs;
+	struct list_head pack_free;
+	struct hrtimer pack_timer;
+	struct usb_anchor pack_anchor;
+};
+
+/*
+ * @urb: urb for a CPort out message
+ * @message: the message being sent with @urb
+ * @cport_id: the CPort @message is sent to
+ * @ref: references to a pre-allocated urb, held by its message and by
+ *	 message_cancel(); the urb is free again once they are all dropped
+ *
+ * Each urb's context points to its es1_cport_out_urb, and the hcpriv field
+ * of the message being sent points to it too.
+ */
+struct es1_cport_out_urb {
+	struct urb *urb;
+	struct gb_message *message;
+	u16 cport_id;
+	atomic_t ref;
+};
+
+/*
+ * @out: the urb the messages are sent with, whose message is NULL; the hcpriv
+ *	 field of each message points to it
+ * @cport_out: the endpoint the messages are sent to
+ * @links: entry in the @pack_free list of @cport_out
+ * @buffer: the transfer buffer, the messages are copied to it on submission
+ * @len: size of the transfer
+ * @submitted: set once the transfer is submitted, messages can no longer be
+ *	       added to it, and cancelled ones are only detached from it
+ * @count: number of messages in the transfer
+ * @messages: the messages, in sending order; NULL for those detached once
+ *	      the transfer has been submitted
+ * @cport_ids: the CPort each message is sent to
+ */
+struct es1_cport_out_pack {
+	struct es1_cport_out_urb out;
+	struct es1_cport_out *cport_out;
+	struct list_head links;
+	void *buffer;
+	size_t len;
+	bool submitted;
+	unsigned int count;
+	struct gb_message *messages[PACK_MESSAGES_MAX];
+	u16 cport_ids[PACK_MESSAGES_MAX];
 };
 
 /**
@@ -118,6 +284,45 @@ struct direct_mapped_ep {
 	struct cport_to_ep cport_to_ep[0];
 };
 
+/**
+ * es1_cport_traffic - CPort traffic, for the endpoints mapping policy
+ * @bytes: bytes sent and received since the policy last ran
+ * @in_flight: number of messages being sent
+ * @rate: smoothed traffic, in bytes per second
+ * @idle: number of policy runs since a mapped CPort was last busy
+ * @remapping: set, under the cport_out_urb_lock, while the CPort is moved
+ *	       to another endpoints pair; its messages are then held back
+ */
+struct es1_cport_traffic {
+	atomic_t bytes;
+	atomic_t in_flight;
+	unsigned int rate;
+	unsigned int idle;
+	bool remapping;
+};
+
+/* A message held back while its CPort is moved to another endpoints pair */
+struct es1_deferred_message {
+	struct list_head links;
+	struct gb_message *message;
+};
+
+/**
+ * es1_dma_pool - fixed-size buffers carved out of a coherent allocation
+ * @cpu: the buffers, allocated with usb_alloc_coherent()
+ * @dma: DMA address of @cpu
+ * @size: size of each buffer
+ * @count: number of buffers
+ * @busy: bitmap of the buffers in use, updated with atomic bit operations
+ */
+struct es1_dma_pool {
+	void *cpu;
+	dma_addr_t dma;
+	size_t size;
+	unsigned int count;
+	unsigned long *busy;
+};
+
 /**
  * es1_ap_dev - ES1 USB Bridge to AP structure
  * @usb_dev: pointer to the USB device we are.
@@ -126,13 +331,41 @@ struct direct_mapped_ep {
 
  * @cport_in: endpoint, urbs and buffer for cport in messages
  * @cport_out: endpoint for for cport out messages
- * @cport_out_urb: array of urbs for the CPort out messages
- * @cport_out_urb_busy: array of flags to see if the @cport_out_urb is busy or
- *			not.
- * @cport_out_urb_cancelled: array of flags indicating whether the
- *			corresponding @cport_out_urb is being cancelled
- * @cport_out_urb_lock: locks the @cport_out_urb_busy "list"
+ * @cport_out_urb: array of pre-allocated urbs for the CPort out messages
+ * @cport_out_urb_busy: bitmap of the @cport_out_urb in use, or without an
+ *			urb, updated with atomic bit operations
+ * @cport_out_urb_lock: locks the hcpriv field of messages sent with a
+ *			dynamically allocated urb
+ * @cport_out_urbs: number of pre-allocated urbs in @cport_out_urb
+ * @cport_out_urbs_peak: largest value of @cport_out_urbs
+ * @cport_out_urb_in_use: number of pre-allocated urbs in use
+ * @cport_out_urb_in_use_peak: largest @cport_out_urb_in_use since the pool
+ *			was last resized
+ * @cport_out_urb_fallbacks: number of urbs dynamically allocated because the
+ *			pool was exhausted
+ * @cport_out_urb_fallbacks_seen: @cport_out_urb_fallbacks when the pool was
+ *			last resized
+ * @cport_out_urb_idle: number of pool resizes since the pool was last busy
+ * @cport_{in,out}_urbs_{min,max}: bounds of the urb pools
+ * @urb_pool_work: periodically resizes the urb pools
+ * @cport_in_buffer_spare: stack of buffers to refill the CPort in urbs with
+ * @cport_in_buffer_spare_count: number of buffers in @cport_in_buffer_spare
+ * @cport_in_buffer_lock: locks the @cport_in_buffer_spare stack
  * @mapped_ep: list of cports and their mapping to endpoints pair
+ * @cport_traffic: traffic of each cport
+ * @ep_map_mutex: serialises changes to the cport to endpoints mapping
+ * @ep_map_work: periodically maps busy cports to dedicated endpoints pairs
+ * @ep_maps: number of cports mapped to a dedicated endpoints pair
+ * @ep_unmaps: number of cports moved back to the muxed endpoints pair
+ * @ep_map_failures: number of mapping requests the APBridge rejected
+ * @ep_remap_deferred: messages held back while a cport is being moved, in
+ *		       sending order; their hcpriv field points to the list
+ * @packing: whether APBridge accepted to pack messages in bulk transfers
+ * @packs: number of packed transfers submitted
+ * @packed_messages: number of messages sent in packed transfers
+ * @transfer_pool: coherent transfer buffers
+ * @message_pool: coherent buffers for small outbound messages, kept until
+ *		  the host device is released as messages can outlive it
  */
 struct es1_ap_dev {
 	struct usb_device *usb_dev;
@@ -141,12 +374,42 @@ struct es1_ap_dev {
 
 	struct es1_cport_in cport_in[NUM_BULKS];
 	struct es1_cport_out cport_out[NUM_BULKS];
-	struct urb *cport_out_urb[NUM_CPORT_OUT_URB];
-	bool cport_out_urb_busy[NUM_CPORT_OUT_URB];
-	bool cport_out_urb_cancelled[NUM_CPORT_OUT_URB];
+	struct es1_cport_out_urb cport_out_urb[NUM_CPORT_OUT_URB_MAX];
+	DECLARE_BITMAP(cport_out_urb_busy, NUM_CPORT_OUT_URB_MAX);
 	spinlock_t cport_out_urb_lock;
+	unsigned int cport_out_urbs;
+	unsigned int cport_out_urbs_peak;
+	atomic_t cport_out_urb_in_use;
+	atomic_t cport_out_urb_in_use_peak;
+	atomic_t cport_out_urb_fallbacks;
+	unsigned int cport_out_urb_fallbacks_seen;
+	unsigned int cport_out_urb_idle;
+
+	unsigned int cport_in_urbs_min;
+	unsigned int cport_in_urbs_max;
+	unsigned int cport_out_urbs_min;
+	unsigned int cport_out_urbs_max;
+	struct delayed_work urb_pool_work;
+
+	void *cport_in_buffer_spare[NUM_CPORT_IN_BUFFER_SPARE];
+	unsigned int cport_in_buffer_spare_count;
+	spinlock_t cport_in_buffer_lock;
 
 	struct direct_mapped_ep *mapped_ep;
+	struct es1_cport_traffic *cport_traffic;
+	struct mutex ep_map_mutex;
+	struct delayed_work ep_map_work;
+	unsigned int ep_maps;
+	unsigned int ep_unmaps;
+	unsigned int ep_map_failures;
+	struct list_head ep_remap_deferred;
+
+	bool packing;
+	atomic_t packs;
+	atomic_t packed_messages;
+
+	struct es1_dma_pool transfer_pool;
+	struct es1_dma_pool message_pool;
 };
 
 static inline struct es1_ap_dev *hd_to_es1(struct greybus_host_device *hd)
@@ -154,7 +417,11 @@ static inline struct es1_ap_dev *hd_to_es1(struct greybus_host_device *hd)
 	return (struct es1_ap_dev *)&hd->hd_priv;
 }
 
+static void cport_in_callback(struct urb *urb);
 static void cport_out_callback(struct urb *urb);
+static int check_urb_status(struct urb *urb);
+static int __message_send(struct es1_ap_dev *es1, u16 cport_id,
+			  struct gb_message *message, gfp_t gfp_mask);
 static void usb_log_enable(struct es1_ap_dev *es1);
 static void usb_log_disable(struct es1_ap_dev *es1);
 
@@ -241,7 +508,7 @@ static struct direct_mapped_ep *direct_mapped_ep_alloc(struct es1_ap_dev *es1,
 	if (!mapped_ep)
 		return NULL;
 	mapped_ep->es1 = es1;
-	bitmap_zero(mapped_ep->ep_pair_map, cport_count);
+	bitmap_zero(mapped_ep->ep_pair_map, NUM_BULKS);
 	set_bit(MUXED_EP_PAIR, mapped_ep->ep_pair_map);
 
 	return mapped_ep;
@@ -249,8 +516,7 @@ static struct direct_mapped_ep *direct_mapped_ep_alloc(struct es1_ap_dev *es1,
 
 static void direct_mapped_ep_free(struct direct_mapped_ep *mapped_ep)
 {
-	if (!mapped_ep)
-		kfree(mapped_ep);
+	kfree(mapped_ep);
 }
 
 /* Get the endpoints pair mapped to the cport */
@@ -267,22 +533,141 @@ static int cport_to_ep_pair(struct es1_ap_dev *es1, u16 cport_id)
 
 #define ES1_TIMEOUT	500	/* 500 ms for the SVC to do something */
 
-/* Disable for now until we work all of this out to keep a warning-free build */
-#if 0
-/* Test if the endpoints pair is already mapped to a cport */
-static int ep_pair_in_use(struct es1_ap_dev *es1, int ep_pair)
+/* Send an endpoints mapping request to APBridge */
+static int ep_mapping_request(struct es1_ap_dev *es1, u16 cport_id,
+			      int ep_pair)
 {
-	struct direct_mapped_ep *mapped_ep = es1->mapped_ep;
+	struct cport_to_ep *req;
+	int retval;
+
+	req = kmalloc(sizeof(*req), GFP_KERNEL);
+	if (!req)
+		return -ENOMEM;
+
+	req->cport_id = cpu_to_le16(cport_id);
+	req->endpoint_out = ep_pair_to_bulk_out(ep_pair);
+	req->endpoint_in = ep_pair_to_bulk_in(ep_pair);
+
+	retval = usb_control_msg(es1->usb_dev,
+				 usb_sndctrlpipe(es1->usb_dev, 0),
+				 REQUEST_EP_MAPPING,
+				 USB_DIR_OUT | USB_TYPE_VENDOR | USB_RECIP_INTERFACE,
+				 0x00, 0x00,
+				 (char *)req,
+				 sizeof(*req),
+				 ES1_TIMEOUT);
+	kfree(req);
+
+	if (retval == sizeof(*req))
+		return 0;
+	if (retval >= 0)
+		retval = -EIO;
+
+	es1->ep_map_failures++;
 
-	return test_bit(ep_pair, mapped_ep->ep_pair_map);
+	return retval;
 }
 
-/* Configure the endpoint mapping and send the request to APBridge */
+/*
+ * Hold back new messages to a cport about to be moved to another endpoints
+ * pair, and wait for those being sent to complete, so that messages are not
+ * reordered across endpoints.  ep_remap_end() must be called afterwards,
+ * even on failure.
+ */
+static int ep_remap_begin(struct es1_ap_dev *es1, u16 cport_id)
+{
+	struct es1_cport_traffic *traffic = &es1->cport_traffic[cport_id];
+	unsigned long timeout = jiffies + EP_MAP_DRAIN_TIMEOUT;
+
+	spin_lock_irq(&es1->cport_out_urb_lock);
+	traffic->remapping = true;
+	spin_unlock_irq(&es1->cport_out_urb_lock);
+
+	/* Pairs with the barrier in message_send() */
+	smp_mb();
+
+	while (atomic_read(&traffic->in_flight)) {
+		if (time_after(jiffies, timeout))
+			return -EBUSY;
+		usleep_range(500, 1000);
+	}
+
+	return 0;
+}
+
+/* Send the messages held back during a move, and let new ones through */
+static void ep_remap_end(struct es1_ap_dev *es1, u16 cport_id)
+{
+	struct es1_cport_traffic *traffic = &es1->cport_traffic[cport_id];
+	struct es1_deferred_message *deferred;
+	struct gb_message *message;
+	int retval;
+
+	for (;;) {
+		spin_lock_irq(&es1->cport_out_urb_lock);
+		if (list_empty(&es1->ep_remap_deferred)) {
+			traffic->remapping = false;
+			spin_unlock_irq(&es1->cport_out_urb_lock);
+			break;
+		}
+		deferred = list_first_entry(&es1->ep_remap_deferred,
+					    struct es1_deferred_message, links);
+		list_del(&deferred->links);
+		spin_unlock_irq(&es1->cport_out_urb_lock);
+
+		message = deferred->message;
+		kfree(deferred);
+
+		message->hcpriv = NULL;
+		atomic_inc(&traffic->in_flight);
+		retval = __message_send(es1, cport_id, message, GFP_KERNEL);
+		if (retval)
+			greybus_message_sent(es1->hd, message, retval);
+	}
+}
+
+/*
+ * Hold back a message to a cport being moved to another endpoints pair.
+ * Returns -EAGAIN if the move is over and the message can be sent.
+ */
+static int ep_remap_defer(struct es1_ap_dev *es1, u16 cport_id,
+			  struct gb_message *message, gfp_t gfp_mask)
+{
+	struct es1_cport_traffic *traffic = &es1->cport_traffic[cport_id];
+	struct es1_deferred_message *deferred;
+	unsigned long flags;
+
+	deferred = kmalloc(sizeof(*deferred), gfp_mask);
+	if (!deferred) {
+		atomic_dec(&traffic->in_flight);
+		return -ENOMEM;
+	}
+	deferred->message = message;
+
+	spin_lock_irqsave(&es1->cport_out_urb_lock, flags);
+	if (!traffic->remapping) {
+		spin_unlock_irqrestore(&es1->cport_out_urb_lock, flags);
+		kfree(deferred);
+		return -EAGAIN;
+	}
+	message->hcpriv = &es1->ep_remap_deferred;
+	list_add_tail(&deferred->links, &es1->ep_remap_deferred);
+	spin_unlock_irqrestore(&es1->cport_out_urb_lock, flags);
+
+	/* Held back messages are not in flight, the move waits for those */
+	atomic_dec(&traffic->in_flight);
+
+	return 0;
+}
+
+/*
+ * Configure the endpoint mapping and send the request to APBridge.  The
+ * local mapping is only updated once APBridge has accepted it.
+ */
 static int map_cport_to_ep(struct es1_ap_dev *es1,
 				u16 cport_id, int ep_pair)
 {
 	int retval;
-	struct cport_to_ep *cport_to_ep;
 
 	if (ep_pair < 0 || ep_pair >= NUM_BULKS)
 		return -EINVAL;
@@ -291,88 +676,694 @@ static int map_cport_to_ep(struct es1_ap_dev *es1,
 	if (reserve_ep_pair(es1, ep_pair))
 		return -EBUSY;
 
-	mapped_ep_init(es1, cport_id, ep_pair);
-	cport_to_ep = get_mapped_ep(es1, cport_id);
+	retval = ep_remap_begin(es1, cport_id);
+	if (!retval)
+		retval = ep_mapping_request(es1, cport_id, ep_pair);
+	if (retval) {
+		ep_remap_end(es1, cport_id);
+		release_ep_pair(es1, ep_pair);
+		return retval;
+	}
 
-	retval = usb_control_msg(es1->usb_dev,
-				 usb_sndctrlpipe(es1->usb_dev, 0),
-				 REQUEST_EP_MAPPING,
-				 USB_DIR_OUT | USB_TYPE_VENDOR | USB_RECIP_INTERFACE,
-				 0x00, 0x00,
-				 (char *)cport_to_ep,
-				 sizeof(*cport_to_ep),
-				 ES1_TIMEOUT);
-	if (retval == sizeof(*cport_to_ep))
-		retval = 0;
+	mapped_ep_init(es1, cport_id, ep_pair);
+	ep_remap_end(es1, cport_id);
 
-	return retval;
+	return 0;
 }
 
-/* Unmap a cport: use the muxed endpoints pair */
+/*
+ * Unmap a cport: use the muxed endpoints pair.  The local mapping is reset
+ * even if APBridge can not be told, as messages can always be sent through
+ * the muxed endpoints, but not while messages of the cport are still being
+ * sent through its dedicated ones.
+ */
 static int unmap_cport(struct es1_ap_dev *es1, u16 cport_id)
 {
 	int ep_pair;
+	int retval;
 
 	ep_pair = cport_to_ep_pair(es1, cport_id);
+	if (ep_pair == MUXED_EP_PAIR)
+		return 0;
+
+	retval = ep_remap_begin(es1, cport_id);
+	if (retval) {
+		ep_remap_end(es1, cport_id);
+		return retval;
+	}
+
+	retval = ep_mapping_request(es1, cport_id, MUXED_EP_PAIR);
+
+	muxed_ep_init(es1, cport_id);
 	release_ep_pair(es1, ep_pair);
+	ep_remap_end(es1, cport_id);
 
-	/* Unmap a cport mean use the muxed enpoints pair (0) */
-	return map_cport_to_ep(es1, cport_id, MUXED_EP_PAIR);
+	return retval;
 }
-#endif
 
-static struct urb *next_free_urb(struct es1_ap_dev *es1, gfp_t gfp_mask)
+/* Protocols whose messages should not wait behind bulk transfers */
+static bool cport_latency_sensitive(struct gb_connection *connection)
 {
-	struct urb *urb = NULL;
-	unsigned long flags;
-	int i;
+	switch (connection->protocol_id) {
+	case GREYBUS_PROTOCOL_HID:
+	case GREYBUS_PROTOCOL_I2S_MGMT:
+	case GREYBUS_PROTOCOL_I2S_RECEIVER:
+	case GREYBUS_PROTOCOL_I2S_TRANSMITTER:
+		return true;
+	default:
+		return false;
+	}
+}
 
-	spin_lock_irqsave(&es1->cport_out_urb_lock, flags);
+/*
+ * Whether a cport deserves a dedicated endpoints pair, with the thresholds
+ * being halved for those already mapped.
+ */
+static bool cport_wants_ep_pair(struct es1_ap_dev *es1, u16 cport_id,
+				bool mapped)
+{
+	struct es1_cport_traffic *traffic = &es1->cport_traffic[cport_id];
+	struct gb_connection *connection;
+	unsigned int rate = 0;
+
+	if (!traffic->rate)
+		return false;
+
+	rcu_read_lock();
+	connection = rcu_dereference(es1->hd->cport_connections[cport_id]);
+	if (connection &&
+	    connection->protocol_id != GREYBUS_PROTOCOL_CONTROL &&
+	    connection->protocol_id != GREYBUS_PROTOCOL_SVC) {
+		if (cport_latency_sensitive(connection))
+			rate = ACCESS_ONCE(ep_map_latency_rate);
+		else
+			rate = ACCESS_ONCE(ep_map_hot_rate);
+		if (!rate)
+			rate = 1;
+	}
+	rcu_read_unlock();
 
-	/* Look in our pool of allocated urbs first, as that's the "fastest" */
-	for (i = 0; i < NUM_CPORT_OUT_URB; ++i) {
-		if (es1->cport_out_urb_busy[i] == false &&
-				es1->cport_out_urb_cancelled[i] == false) {
-			es1->cport_out_urb_busy[i] = true;
-			urb = es1->cport_out_urb[i];
+	if (!rate)
+		return false;
+	if (mapped)
+		rate = DIV_ROUND_UP(rate, 2);
+
+	return traffic->rate >= rate;
+}
+
+/*
+ * Update the traffic rate of every cport, move idle cports back to the
+ * muxed endpoints pair, and map the busiest cport that deserves it to a
+ * free endpoints pair.  At most one cport is mapped per run, and cports
+ * with messages in flight are left alone, as moving them has to wait for
+ * those messages to be sent.
+ */
+static void ep_map_update(struct es1_ap_dev *es1)
+{
+	struct es1_cport_traffic *traffic;
+	unsigned int best_rate = 0;
+	int best = -1;
+	int ep_pair;
+	u32 bytes;
+	u16 cport_id;
+
+	for (cport_id = 0; cport_id < es1->hd->num_cports; cport_id++) {
+		traffic = &es1->cport_traffic[cport_id];
+
+		bytes = atomic_xchg(&traffic->bytes, 0);
+		traffic->rate = (traffic->rate * 3 + bytes) / 4;
+
+		if (cport_to_ep_pair(es1, cport_id) != MUXED_EP_PAIR) {
+			if (cport_wants_ep_pair(es1, cport_id, true)) {
+				traffic->idle = 0;
+				continue;
+			}
+			if (++traffic->idle < EP_MAP_IDLE_PERIODS ||
+			    atomic_read(&traffic->in_flight))
+				continue;
+
+			traffic->idle = 0;
+			if (!unmap_cport(es1, cport_id))
+				es1->ep_unmaps++;
+			continue;
+		}
+
+		if (traffic->rate > best_rate &&
+		    !atomic_read(&traffic->in_flight) &&
+		    cport_wants_ep_pair(es1, cport_id, false)) {
+			best_rate = traffic->rate;
+			best = cport_id;
+		}
+	}
+
+	ep_pair = find_first_unmapped_ep_pair(es1);
+	if (best < 0 || ep_pair == MUXED_EP_PAIR)
+		return;
+
+	if (!map_cport_to_ep(es1, best, ep_pair)) {
+		es1->cport_traffic[best].idle = 0;
+		es1->ep_maps++;
+	}
+}
+
+static void ep_map_work(struct work_struct *work)
+{
+	struct es1_ap_dev *es1 = container_of(to_delayed_work(work),
+					      struct es1_ap_dev, ep_map_work);
+
+	if (ACCESS_ONCE(ep_map_auto)) {
+		mutex_lock(&es1->ep_map_mutex);
+		ep_map_update(es1);
+		mutex_unlock(&es1->ep_map_mutex);
+	}
+
+	schedule_delayed_work(&es1->ep_map_work, EP_MAP_PERIOD);
+}
+
+static inline bool cport_out_urb_pooled(struct es1_ap_dev *es1,
+					struct es1_cport_out_urb *out)
+{
+	return out >= es1->cport_out_urb &&
+	       out < es1->cport_out_urb + NUM_CPORT_OUT_URB_MAX;
+}
+
+/* Drop a reference to a pre-allocated urb, freeing it if it was the last */
+static void cport_out_urb_put(struct es1_ap_dev *es1,
+			      struct es1_cport_out_urb *out)
+{
+	if (atomic_dec_and_test(&out->ref)) {
+		atomic_dec(&es1->cport_out_urb_in_use);
+		clear_bit_unlock(out - es1->cport_out_urb,
+				 es1->cport_out_urb_busy);
+	}
+}
+
+static struct es1_cport_out_urb *next_free_urb(struct es1_ap_dev *es1,
+					       gfp_t gfp_mask)
+{
+	struct es1_cport_out_urb *out;
+	unsigned int in_use;
+	unsigned int i;
+
+	/*
+	 * Look in our pool of allocated urbs first, as that's the "fastest".
+	 * The bitmap covers NUM_CPORT_OUT_URB_MAX slots, four words on 64-bit
+	 * builds, and slots without an urb are kept busy, so the scan usually
+	 * stops within the first word or two.
+	 */
+	for (;;) {
+		i = find_first_zero_bit(es1->cport_out_urb_busy,
+					NUM_CPORT_OUT_URB_MAX);
+		if (i >= NUM_CPORT_OUT_URB_MAX)
 			break;
+		if (!test_and_set_bit_lock(i, es1->cport_out_urb_busy)) {
+			out = &es1->cport_out_urb[i];
+
+			/* Emptied by disconnect; keep it busy */
+			if (!ACCESS_ONCE(out->urb))
+				continue;
+
+			atomic_set(&out->ref, 1);
+
+			in_use = atomic_inc_return(&es1->cport_out_urb_in_use);
+			if (in_use > atomic_read(&es1->cport_out_urb_in_use_peak))
+				atomic_set(&es1->cport_out_urb_in_use_peak,
+					   in_use);
+
+			return out;
 		}
 	}
-	spin_unlock_irqrestore(&es1->cport_out_urb_lock, flags);
-	if (urb)
-		return urb;
 
 	/*
-	 * Crap, pool is empty, complain to the syslog and go allocate one
-	 * dynamically as we have to succeed.
+	 * Pool is empty, go allocate one dynamically as we have to succeed.
+	 * The pool will grow the next time it is resized.
 	 */
-	dev_err(&es1->usb_dev->dev,
+	atomic_inc(&es1->cport_out_urb_fallbacks);
+	dev_dbg(&es1->usb_dev->dev,
 		"No free CPort OUT urbs, having to dynamically allocate one!\n");
-	return usb_alloc_urb(0, gfp_mask);
+
+	out = kzalloc(sizeof(*out), gfp_mask);
+	if (!out)
+		return NULL;
+
+	out->urb = usb_alloc_urb(0, gfp_mask);
+	if (!out->urb) {
+		kfree(out);
+		return NULL;
+	}
+
+	return out;
 }
 
-static void free_urb(struct es1_ap_dev *es1, struct urb *urb)
+static void free_urb(struct es1_ap_dev *es1, struct es1_cport_out_urb *out)
 {
-	unsigned long flags;
-	int i;
 	/*
-	 * See if this was an urb in our pool, if so mark it "free", otherwise
-	 * we need to free it ourselves.
+	 * If this was an urb in our pool, drop the message's reference to
+	 * it, otherwise we need to free it ourselves.
 	 */
+	if (cport_out_urb_pooled(es1, out)) {
+		cport_out_urb_put(es1, out);
+		return;
+	}
+
+	usb_free_urb(out->urb);
+	kfree(out);
+}
+
+/*
+ * Detach an urb from its message once it has completed, or failed to be
+ * submitted.  Dynamically allocated urbs are about to be freed, which
+ * message_cancel() must not race with.
+ */
+static void cport_out_urb_detach(struct es1_ap_dev *es1,
+				 struct es1_cport_out_urb *out)
+{
+	unsigned long flags;
+
+	if (cport_out_urb_pooled(es1, out)) {
+		ACCESS_ONCE(out->message->hcpriv) = NULL;
+		return;
+	}
+
 	spin_lock_irqsave(&es1->cport_out_urb_lock, flags);
-	for (i = 0; i < NUM_CPORT_OUT_URB; ++i) {
-		if (urb == es1->cport_out_urb[i]) {
-			es1->cport_out_urb_busy[i] = false;
-			urb = NULL;
+	out->message->hcpriv = NULL;
+	spin_unlock_irqrestore(&es1->cport_out_urb_lock, flags);
+}
+
+/* Add pre-allocated CPort OUT urbs to the pool, up to @target */
+static void cport_out_pool_grow(struct es1_ap_dev *es1, unsigned int target)
+{
+	struct es1_cport_out_urb *out;
+	unsigned int i;
+
+	for (i = 0; i < NUM_CPORT_OUT_URB_MAX; i++) {
+		if (es1->cport_out_urbs >= target)
 			break;
-		}
+
+		/* Slots without an urb are kept busy */
+		out = &es1->cport_out_urb[i];
+		if (out->urb)
+			continue;
+
+		out->urb = usb_alloc_urb(0, GFP_KERNEL);
+		if (!out->urb)
+			break;
+
+		es1->cport_out_urbs++;
+		clear_bit_unlock(i, es1->cport_out_urb_busy);
 	}
-	spin_unlock_irqrestore(&es1->cport_out_urb_lock, flags);
 
-	/* If urb is not NULL, then we need to free this urb */
+	es1->cport_out_urbs_peak = max(es1->cport_out_urbs_peak,
+				       es1->cport_out_urbs);
+}
+
+/* Free idle pre-allocated CPort OUT urbs, down to @target */
+static void cport_out_pool_shrink(struct es1_ap_dev *es1, unsigned int target)
+{
+	struct es1_cport_out_urb *out;
+	int i;
+
+	for (i = NUM_CPORT_OUT_URB_MAX - 1; i >= 0; i--) {
+		if (es1->cport_out_urbs <= target)
+			break;
+
+		out = &es1->cport_out_urb[i];
+		if (!out->urb ||
+		    test_and_set_bit_lock(i, es1->cport_out_urb_busy))
+			continue;
+
+		usb_free_urb(out->urb);
+		out->urb = NULL;
+		es1->cport_out_urbs--;
+	}
+}
+
+static void cport_out_pool_resize(struct es1_ap_dev *es1)
+{
+	unsigned int urbs = es1->cport_out_urbs;
+	unsigned int fallbacks;
+	unsigned int peak;
+
+	peak = atomic_xchg(&es1->cport_out_urb_in_use_peak,
+			   atomic_read(&es1->cport_out_urb_in_use));
+	fallbacks = atomic_read(&es1->cport_out_urb_fallbacks);
+
+	if (fallbacks != es1->cport_out_urb_fallbacks_seen ||
+	    peak * 4 > urbs * 3) {
+		es1->cport_out_urb_fallbacks_seen = fallbacks;
+		es1->cport_out_urb_idle = 0;
+		cport_out_pool_grow(es1, min(urbs * 2,
+					     es1->cport_out_urbs_max));
+	} else if (peak * 4 < urbs) {
+		if (++es1->cport_out_urb_idle < URB_POOL_IDLE_PERIODS)
+			return;
+		es1->cport_out_urb_idle = 0;
+		cport_out_pool_shrink(es1, max(urbs / 2,
+					       es1->cport_out_urbs_min));
+	} else {
+		es1->cport_out_urb_idle = 0;
+	}
+}
+
+static int es1_dma_pool_create(struct es1_ap_dev *es1,
+			       struct es1_dma_pool *pool, unsigned int count,
+			       size_t size)
+{
+	if (!count)
+		return 0;
+
+	pool->busy = kcalloc(BITS_TO_LONGS(count), sizeof(*pool->busy),
+			     GFP_KERNEL);
+	if (!pool->busy)
+		return -ENOMEM;
+
+	pool->cpu = usb_alloc_coherent(es1->usb_dev, count * size, GFP_KERNEL,
+				       &pool->dma);
+	if (!pool->cpu) {
+		kfree(pool->busy);
+		pool->busy = NULL;
+		return -ENOMEM;
+	}
+	pool->size = size;
+	pool->count = count;
+
+	return 0;
+}
+
+static void es1_dma_pool_destroy(struct es1_ap_dev *es1,
+				 struct es1_dma_pool *pool)
+{
+	if (pool->cpu)
+		usb_free_coherent(es1->usb_dev, pool->count * pool->size,
+				  pool->cpu, pool->dma);
+	kfree(pool->busy);
+
+	pool->cpu = NULL;
+	pool->busy = NULL;
+	pool->count = 0;
+}
+
+static void *es1_dma_pool_alloc(struct es1_dma_pool *pool)
+{
+	unsigned int i;
+
+	for (;;) {
+		i = find_first_zero_bit(pool->busy, pool->count);
+		if (i >= pool->count)
+			return NULL;
+		if (!test_and_set_bit_lock(i, pool->busy))
+			return pool->cpu + i * pool->size;
+	}
+}
+
+static inline bool es1_dma_pool_owns(struct es1_dma_pool *pool, void *buffer)
+{
+	return pool->cpu && buffer >= pool->cpu &&
+	       buffer < pool->cpu + pool->count * pool->size;
+}
+
+static void es1_dma_pool_free(struct es1_dma_pool *pool, void *buffer)
+{
+	clear_bit_unlock((buffer - pool->cpu) / pool->size, pool->busy);
+}
+
+static unsigned int es1_dma_pool_in_use(struct es1_dma_pool *pool)
+{
+	if (!pool->count)
+		return 0;
+
+	return bitmap_weight(pool->busy, pool->count);
+}
+
+/* Get a transfer buffer, preferably a coherent one */
+static void *transfer_buffer_alloc(struct es1_ap_dev *es1, gfp_t gfp_mask)
+{
+	void *buffer;
+
+	buffer = es1_dma_pool_alloc(&es1->transfer_pool);
+	if (buffer)
+		return buffer;
+
+	return kmalloc(ES1_GBUF_MSG_SIZE_MAX, gfp_mask);
+}
+
+static void transfer_buffer_free(struct es1_ap_dev *es1, void *buffer)
+{
+	if (es1_dma_pool_owns(&es1->transfer_pool, buffer)) {
+		es1_dma_pool_free(&es1->transfer_pool, buffer);
+		return;
+	}
+
+	kfree(buffer);
+}
+
+/*
+ * Set the transfer buffer of an urb.  Buffers from the coherent pools are
+ * handed to the host controller already mapped, others are mapped by the
+ * USB core when the urb is submitted.
+ */
+static void urb_set_transfer_buffer(struct es1_ap_dev *es1, struct urb *urb,
+				    void *buffer)
+{
+	struct es1_dma_pool *pool = NULL;
+
+	urb->transfer_buffer = buffer;
+
+	if (es1_dma_pool_owns(&es1->transfer_pool, buffer))
+		pool = &es1->transfer_pool;
+	else if (es1_dma_pool_owns(&es1->message_pool, buffer))
+		pool = &es1->message_pool;
+
+	if (pool) {
+		urb->transfer_dma = pool->dma + (buffer - pool->cpu);
+		urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+	} else {
+		urb->transfer_flags &= ~URB_NO_TRANSFER_DMA_MAP;
+	}
+}
+
+static void buffer_free(struct greybus_host_device *hd, void *buffer);
+
+static int cport_in_urb_submit(struct es1_cport_in *cport_in, struct urb *urb,
+			       gfp_t gfp_mask)
+{
+	int retval;
+
+	usb_anchor_urb(urb, &cport_in->anchor);
+	atomic_inc(&cport_in->queued);
+
+	retval = usb_submit_urb(urb, gfp_mask);
+	if (retval) {
+		atomic_dec(&cport_in->queued);
+		usb_unanchor_urb(urb);
+	}
+
+	return retval;
+}
+
+static void cport_in_urb_release(struct es1_cport_in *cport_in,
+				 struct urb *urb)
+{
+	buffer_free(cport_in->es1->hd, urb->transfer_buffer);
 	usb_free_urb(urb);
 }
 
+static void cport_in_urb_free(struct es1_cport_in *cport_in, struct urb *urb)
+{
+	atomic_dec(&cport_in->urbs);
+	cport_in_urb_release(cport_in, urb);
+}
+
+/*
+ * Account for a CPort IN urb to be freed, instead of resubmitted, if the
+ * endpoint has more than its target.
+ */
+static bool cport_in_urb_excess(struct es1_cport_in *cport_in)
+{
+	int target = ACCESS_ONCE(cport_in->target);
+	int urbs = atomic_read(&cport_in->urbs);
+	int old;
+
+	while (urbs > target) {
+		old = atomic_cmpxchg(&cport_in->urbs, urbs, urbs - 1);
+		if (old == urbs)
+			return true;
+		urbs = old;
+	}
+
+	return false;
+}
+
+/* Allocate and submit a new CPort IN urb */
+static int cport_in_urb_add(struct es1_cport_in *cport_in)
+{
+	struct usb_device *udev = cport_in->es1->usb_dev;
+	struct urb *urb;
+	u8 *buffer;
+	int retval;
+
+	urb = usb_alloc_urb(0, GFP_KERNEL);
+	if (!urb)
+		return -ENOMEM;
+
+	buffer = transfer_buffer_alloc(cport_in->es1, GFP_KERNEL);
+	if (!buffer) {
+		usb_free_urb(urb);
+		return -ENOMEM;
+	}
+
+	usb_fill_bulk_urb(urb, udev,
+			  usb_rcvbulkpipe(udev, cport_in->endpoint),
+			  buffer, ES1_GBUF_MSG_SIZE_MAX,
+			  cport_in_callback, cport_in);
+	urb_set_transfer_buffer(cport_in->es1, urb, buffer);
+
+	atomic_inc(&cport_in->urbs);
+	retval = cport_in_urb_submit(cport_in, urb, GFP_KERNEL);
+	if (retval) {
+		cport_in_urb_free(cport_in, urb);
+		return retval;
+	}
+
+	cport_in->urbs_peak = max_t(unsigned int, cport_in->urbs_peak,
+				    atomic_read(&cport_in->urbs));
+
+	return 0;
+}
+
+static void cport_in_pool_resize(struct es1_cport_in *cport_in)
+{
+	struct es1_ap_dev *es1 = cport_in->es1;
+	unsigned int starved = atomic_read(&cport_in->starved);
+	unsigned int target = cport_in->target;
+
+	if (starved != cport_in->starved_seen) {
+		cport_in->starved_seen = starved;
+		cport_in->idle = 0;
+		target = min(target * 2, es1->cport_in_urbs_max);
+	} else if (++cport_in->idle >= URB_POOL_IDLE_PERIODS) {
+		cport_in->idle = 0;
+		target = max(target - 1, es1->cport_in_urbs_min);
+	}
+
+	/* Excess urbs are freed as they complete */
+	ACCESS_ONCE(cport_in->target) = target;
+
+	while (atomic_read(&cport_in->urbs) < target) {
+		if (cport_in_urb_add(cport_in))
+			break;
+	}
+}
+
+static void urb_pool_work(struct work_struct *work)
+{
+	struct es1_ap_dev *es1 = container_of(to_delayed_work(work),
+					      struct es1_ap_dev, urb_pool_work);
+	int bulk_in;
+
+	for (bulk_in = 0; bulk_in < NUM_BULKS; bulk_in++)
+		cport_in_pool_resize(&es1->cport_in[bulk_in]);
+
+	cport_out_pool_resize(es1);
+
+	schedule_delayed_work(&es1->urb_pool_work, URB_POOL_PERIOD);
+}
+
+/*
+ * Get a buffer to refill a CPort in urb with, preferably one previously
+ * handed back by the greybus core.
+ */
+static void *cport_in_buffer_get(struct es1_ap_dev *es1)
+{
+	void *buffer = NULL;
+	unsigned long flags;
+
+	spin_lock_irqsave(&es1->cport_in_buffer_lock, flags);
+	if (es1->cport_in_buffer_spare_count) {
+		es1->cport_in_buffer_spare_count--;
+		buffer = es1->cport_in_buffer_spare[
+					es1->cport_in_buffer_spare_count];
+	}
+	spin_unlock_irqrestore(&es1->cport_in_buffer_lock, flags);
+
+	if (buffer)
+		return buffer;
+
+	return transfer_buffer_alloc(es1, GFP_ATOMIC);
+}
+
+/*
+ * Take back a CPort in buffer, either loaned to the greybus core or unused,
+ * and keep it for reuse unless we already have enough spares.
+ */
+static void buffer_free(struct greybus_host_device *hd, void *buffer)
+{
+	struct es1_ap_dev *es1 = hd_to_es1(hd);
+	unsigned long flags;
+
+	spin_lock_irqsave(&es1->cport_in_buffer_lock, flags);
+	if (es1->cport_in_buffer_spare_count < NUM_CPORT_IN_BUFFER_SPARE) {
+		es1->cport_in_buffer_spare[es1->cport_in_buffer_spare_count++] =
+									buffer;
+		buffer = NULL;
+	}
+	spin_unlock_irqrestore(&es1->cport_in_buffer_lock, flags);
+
+	transfer_buffer_free(es1, buffer);
+}
+
+/*
+ * Small outbound messages get a coherent buffer, when one is free.  Those
+ * that will be copied into a packed transfer are better off in cached
+ * memory, as their own buffer is never used for DMA.
+ */
+static void *message_buffer_alloc(struct greybus_host_device *hd, size_t size,
+				  gfp_t gfp_mask)
+{
+	struct es1_ap_dev *es1 = hd_to_es1(hd);
+
+	if (size > es1->message_pool.size)
+		return NULL;
+
+	if (es1->packing && size <= PACK_MESSAGE_SIZE_MAX &&
+	    ACCESS_ONCE(pack_window_us))
+		return NULL;
+
+	return es1_dma_pool_alloc(&es1->message_pool);
+}
+
+static void message_buffer_free(struct greybus_host_device *hd, void *buffer)
+{
+	struct es1_ap_dev *es1 = hd_to_es1(hd);
+
+	es1_dma_pool_free(&es1->message_pool, buffer);
+}
+
+/*
+ * Called once the last message buffer is gone, which may be well after
+ * disconnect.
+ */
+static void hd_release(struct greybus_host_device *hd)
+{
+	struct es1_ap_dev *es1 = hd_to_es1(hd);
+
+	es1_dma_pool_destroy(es1, &es1->message_pool);
+	usb_put_dev(es1->usb_dev);
+}
+
+static void cport_in_buffers_free(struct es1_ap_dev *es1)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&es1->cport_in_buffer_lock, flags);
+	while (es1->cport_in_buffer_spare_count) {
+		es1->cport_in_buffer_spare_count--;
+		transfer_buffer_free(es1, es1->cport_in_buffer_spare[
+					es1->cport_in_buffer_spare_count]);
+	}
+	spin_unlock_irqrestore(&es1->cport_in_buffer_lock, flags);
+}
+
 /*
  * We (ab)use the operation-message header pad bytes to transfer the
  * cport id in order to minimise overhead.
@@ -389,72 +1380,396 @@ static void gb_message_cport_clear(struct gb_operation_msg_hdr *header)
 	header->pad[0] = 0;
 }
 
-/* Extract the CPort id packed into the header, and clear it */
-static u16 gb_message_cport_unpack(struct gb_operation_msg_hdr *header)
+/* Extract the CPort id packed into the header, and clear it */
+static u16 gb_message_cport_unpack(struct gb_operation_msg_hdr *header)
+{
+	u16 cport_id = header->pad[0];
+
+	gb_message_cport_clear(header);
+
+	return cport_id;
+}
+
+static void cport_out_packs_free(struct es1_cport_out *cport_out)
+{
+	struct es1_cport_out_pack *pack;
+	unsigned int i;
+
+	if (!cport_out->packs)
+		return;
+
+	for (i = 0; i < NUM_CPORT_OUT_PACKS; i++) {
+		pack = &cport_out->packs[i];
+		usb_free_urb(pack->out.urb);
+		transfer_buffer_free(cport_out->es1, pack->buffer);
+	}
+	kfree(cport_out->packs);
+	cport_out->packs = NULL;
+	INIT_LIST_HEAD(&cport_out->pack_free);
+}
+
+/* Pre-allocate the packed transfers of an endpoint, with their urb */
+static int cport_out_packs_alloc(struct es1_cport_out *cport_out)
+{
+	struct es1_cport_out_pack *pack;
+	unsigned int i;
+
+	cport_out->packs = kcalloc(NUM_CPORT_OUT_PACKS,
+				   sizeof(*cport_out->packs), GFP_KERNEL);
+	if (!cport_out->packs)
+		return -ENOMEM;
+
+	for (i = 0; i < NUM_CPORT_OUT_PACKS; i++) {
+		pack = &cport_out->packs[i];
+		pack->cport_out = cport_out;
+		pack->buffer = transfer_buffer_alloc(cport_out->es1,
+						     GFP_KERNEL);
+		pack->out.urb = usb_alloc_urb(0, GFP_KERNEL);
+		if (!pack->buffer || !pack->out.urb) {
+			cport_out_packs_free(cport_out);
+			return -ENOMEM;
+		}
+		list_add_tail(&pack->links, &cport_out->pack_free);
+	}
+
+	return 0;
+}
+
+/* Take a free packed transfer, if any.  Called with the pack_lock held. */
+static struct es1_cport_out_pack *
+cport_out_pack_get(struct es1_cport_out *cport_out)
+{
+	struct es1_cport_out_pack *pack;
+
+	if (list_empty(&cport_out->pack_free))
+		return NULL;
+
+	pack = list_first_entry(&cport_out->pack_free,
+				struct es1_cport_out_pack, links);
+	list_del(&pack->links);
+
+	pack->len = 0;
+	pack->submitted = false;
+	pack->count = 0;
+
+	return pack;
+}
+
+/* Put a packed transfer back on its endpoint's free list */
+static void cport_out_pack_put(struct es1_cport_out_pack *pack)
+{
+	struct es1_cport_out *cport_out = pack->cport_out;
+	unsigned long flags;
+
+	spin_lock_irqsave(&cport_out->pack_lock, flags);
+	list_add(&pack->links, &cport_out->pack_free);
+	spin_unlock_irqrestore(&cport_out->pack_lock, flags);
+}
+
+/* Report the status of the messages of a packed transfer, and free it */
+static void cport_out_pack_complete(struct es1_cport_out_pack *pack,
+				    int status)
+{
+	struct es1_ap_dev *es1 = pack->cport_out->es1;
+	unsigned long flags;
+	unsigned int i;
+
+	spin_lock_irqsave(&es1->cport_out_urb_lock, flags);
+	for (i = 0; i < pack->count; i++) {
+		if (pack->messages[i])
+			pack->messages[i]->hcpriv = NULL;
+	}
+	spin_unlock_irqrestore(&es1->cport_out_urb_lock, flags);
+
+	for (i = 0; i < pack->count; i++) {
+		if (!pack->messages[i])
+			continue;
+		atomic_dec(&es1->cport_traffic[pack->cport_ids[i]].in_flight);
+		greybus_message_sent(es1->hd, pack->messages[i], status);
+	}
+
+	cport_out_pack_put(pack);
+}
+
+static void cport_out_pack_callback(struct urb *urb)
+{
+	struct es1_cport_out_pack *pack = urb->context;
+
+	cport_out_pack_complete(pack, check_urb_status(urb));
+}
+
+/*
+ * Copy the messages of a packed transfer to its buffer, and submit it.
+ * Called with the pack_lock held, so that the transfers of an endpoint are
+ * submitted in the order they were filled.  On failure, the caller
+ * completes the transfer once the lock has been released.
+ */
+static int cport_out_pack_submit(struct es1_cport_out_pack *pack)
+{
+	struct es1_cport_out *cport_out = pack->cport_out;
+	struct es1_ap_dev *es1 = cport_out->es1;
+	struct usb_device *udev = es1->usb_dev;
+	struct urb *urb = pack->out.urb;
+	struct gb_message *message;
+	size_t offset = 0;
+	size_t size;
+	unsigned int i;
+	int retval;
+
+	pack->submitted = true;
+
+	/* All its messages have been cancelled */
+	if (!pack->count) {
+		list_add(&pack->links, &cport_out->pack_free);
+		return 0;
+	}
+
+	for (i = 0; i < pack->count; i++) {
+		message = pack->messages[i];
+		size = gb_message_size(message);
+
+		memset(pack->buffer + offset, 0,
+		       ALIGN(offset, PACK_ALIGN) - offset);
+		offset = ALIGN(offset, PACK_ALIGN);
+		memcpy(pack->buffer + offset, message->header, size);
+		gb_message_cport_pack(pack->buffer + offset,
+				      pack->cport_ids[i]);
+		trace_gb_host_device_send(es1->hd, pack->cport_ids[i], size);
+		offset += size;
+	}
+
+	usb_fill_bulk_urb(urb, udev,
+			  usb_sndbulkpipe(udev, cport_out->endpoint),
+			  pack->buffer, offset,
+			  cport_out_pack_callback, pack);
+	urb_set_transfer_buffer(es1, urb, pack->buffer);
+	urb->transfer_flags |= URB_ZERO_PACKET;
+
+	atomic_inc(&es1->packs);
+	atomic_add(pack->count, &es1->packed_messages);
+
+	usb_anchor_urb(urb, &cport_out->pack_anchor);
+	retval = usb_submit_urb(urb, GFP_ATOMIC);
+	if (retval) {
+		dev_err(&udev->dev, "error %d submitting packed URB\n",
+			retval);
+		usb_unanchor_urb(urb);
+	}
+
+	return retval;
+}
+
+/*
+ * Submit the packed transfer of an endpoint without waiting.  Called from
+ * interrupt context by the packing window timer.
+ */
+static void cport_out_pack_flush(struct es1_cport_out *cport_out)
+{
+	struct es1_cport_out_pack *pack;
+	unsigned long flags;
+	int retval = 0;
+
+	if (!ACCESS_ONCE(cport_out->pack))
+		return;
+
+	spin_lock_irqsave(&cport_out->pack_lock, flags);
+	pack = cport_out->pack;
+	cport_out->pack = NULL;
+	if (pack)
+		retval = cport_out_pack_submit(pack);
+	spin_unlock_irqrestore(&cport_out->pack_lock, flags);
+
+	if (retval)
+		cport_out_pack_complete(pack, retval);
+}
+
+static enum hrtimer_restart cport_out_pack_timer(struct hrtimer *timer)
+{
+	struct es1_cport_out *cport_out;
+
+	cport_out = container_of(timer, struct es1_cport_out, pack_timer);
+	cport_out_pack_flush(cport_out);
+
+	return HRTIMER_NORESTART;
+}
+
+/*
+ * Add a message to the packed transfer of an endpoint, opening a new one if
+ * there is none or the current one is full.  Returns -EAGAIN if the message
+ * has to be sent on its own.
+ */
+static int cport_out_pack_add(struct es1_cport_out *cport_out, u16 cport_id,
+			      struct gb_message *message)
+{
+	struct es1_cport_out_pack *pack;
+	struct es1_cport_out_pack *failed = NULL;
+	unsigned int window = ACCESS_ONCE(pack_window_us);
+	size_t size = gb_message_size(message);
+	unsigned long flags;
+	bool opened = false;
+	int retval = 0;
+
+	if (message->sg || size > PACK_MESSAGE_SIZE_MAX || !window)
+		return -EAGAIN;
+
+	spin_lock_irqsave(&cport_out->pack_lock, flags);
+	if (!cport_out->packing) {
+		spin_unlock_irqrestore(&cport_out->pack_lock, flags);
+		return -EAGAIN;
+	}
+
+	/* Keep the messages in order: a full transfer goes out first */
+	pack = cport_out->pack;
+	if (pack && (pack->count == PACK_MESSAGES_MAX ||
+		     ALIGN(pack->len, PACK_ALIGN) + size >
+		     ES1_GBUF_MSG_SIZE_MAX)) {
+		retval = cport_out_pack_submit(pack);
+		if (retval)
+			failed = pack;
+		pack = NULL;
+	}
+
+	if (!pack) {
+		pack = cport_out_pack_get(cport_out);
+		cport_out->pack = pack;
+		opened = true;
+	}
+
+	if (pack) {
+		pack->messages[pack->count] = message;
+		pack->cport_ids[pack->count] = cport_id;
+		pack->count++;
+		pack->len = ALIGN(pack->len, PACK_ALIGN) + size;
+		message->hcpriv = &pack->out;
+	}
+	spin_unlock_irqrestore(&cport_out->pack_lock, flags);
+
+	if (failed)
+		cport_out_pack_complete(failed, retval);
+
+	if (!pack)
+		return -EAGAIN;
+
+	if (opened)
+		hrtimer_start(&cport_out->pack_timer,
+			      ns_to_ktime((u64)window * NSEC_PER_USEC),
+			      HRTIMER_MODE_REL);
+
+	return 0;
+}
+
+/*
+ * Remove a message from a packed transfer.  Once the transfer has been
+ * submitted, the message is only detached from it: its content has already
+ * been copied, and the transfer completes for the other messages.  Called
+ * with the cport_out_urb_lock held.
+ */
+static bool cport_out_pack_remove(struct es1_cport_out_pack *pack,
+				  struct gb_message *message)
 {
-	u16 cport_id = header->pad[0];
+	struct es1_cport_out *cport_out = pack->cport_out;
+	struct es1_ap_dev *es1 = cport_out->es1;
+	bool removed = false;
+	unsigned int i;
+
+	spin_lock(&cport_out->pack_lock);
+	for (i = 0; i < pack->count; i++) {
+		if (pack->messages[i] == message)
+			break;
+	}
+	if (i == pack->count)
+		goto out;
 
-	gb_message_cport_clear(header);
+	atomic_dec(&es1->cport_traffic[pack->cport_ids[i]].in_flight);
+	message->hcpriv = NULL;
+	removed = true;
 
-	return cport_id;
+	if (pack->submitted) {
+		pack->messages[i] = NULL;
+		goto out;
+	}
+
+	pack->count--;
+	memmove(&pack->messages[i], &pack->messages[i + 1],
+		(pack->count - i) * sizeof(pack->messages[0]));
+	memmove(&pack->cport_ids[i], &pack->cport_ids[i + 1],
+		(pack->count - i) * sizeof(pack->cport_ids[0]));
+
+	pack->len = 0;
+	for (i = 0; i < pack->count; i++)
+		pack->len = ALIGN(pack->len, PACK_ALIGN) +
+			    gb_message_size(pack->messages[i]);
+out:
+	spin_unlock(&cport_out->pack_lock);
+
+	return removed;
 }
 
 /*
- * Returns zero if the message was successfully queued, or a negative errno
- * otherwise.
+ * Send a message, accounted as in flight, through the endpoints pair of its
+ * cport.
  */
-static int message_send(struct greybus_host_device *hd, u16 cport_id,
-			struct gb_message *message, gfp_t gfp_mask)
+static int __message_send(struct es1_ap_dev *es1, u16 cport_id,
+			  struct gb_message *message, gfp_t gfp_mask)
 {
-	struct es1_ap_dev *es1 = hd_to_es1(hd);
+	struct greybus_host_device *hd = es1->hd;
 	struct usb_device *udev = es1->usb_dev;
+	struct es1_cport_out *cport_out;
+	struct es1_cport_out_urb *out;
 	size_t buffer_size;
 	int retval;
 	struct urb *urb;
 	int ep_pair;
-	unsigned long flags;
 
-	/*
-	 * The data actually transferred will include an indication
-	 * of where the data should be sent.  Do one last check of
-	 * the target CPort id before filling it in.
-	 */
-	if (!cport_id_valid(hd, cport_id)) {
-		pr_err("invalid destination cport 0x%02x\n", cport_id);
-		return -EINVAL;
-	}
+	ep_pair = cport_to_ep_pair(es1, cport_id);
+	cport_out = &es1->cport_out[ep_pair];
+
+	if (!cport_out_pack_add(cport_out, cport_id, message))
+		return 0;
+
+	/* Messages queued for packing before this one go out first */
+	cport_out_pack_flush(cport_out);
 
 	/* Find a free urb */
-	urb = next_free_urb(es1, gfp_mask);
-	if (!urb)
+	out = next_free_urb(es1, gfp_mask);
+	if (!out) {
+		atomic_dec(&es1->cport_traffic[cport_id].in_flight);
 		return -ENOMEM;
+	}
 
-	spin_lock_irqsave(&es1->cport_out_urb_lock, flags);
-	message->hcpriv = urb;
-	spin_unlock_irqrestore(&es1->cport_out_urb_lock, flags);
+	urb = out->urb;
+	out->message = message;
+	out->cport_id = cport_id;
+	message->hcpriv = out;
 
 	/* Pack the cport id into the message header */
 	gb_message_cport_pack(message->header, cport_id);
 
-	buffer_size = sizeof(*message->header) + message->payload_size;
-
-	ep_pair = cport_to_ep_pair(es1, cport_id);
-	usb_fill_bulk_urb(urb, udev,
-			  usb_sndbulkpipe(udev,
-					  es1->cport_out[ep_pair].endpoint),
-			  message->buffer, buffer_size,
-			  cport_out_callback, message);
+	if (message->sg) {
+		buffer_size = gb_message_size(message);
+		usb_fill_bulk_urb(urb, udev,
+				  usb_sndbulkpipe(udev, cport_out->endpoint),
+				  NULL, buffer_size,
+				  cport_out_callback, out);
+	} else {
+		buffer_size = sizeof(*message->header) + message->payload_size;
+		usb_fill_bulk_urb(urb, udev,
+				  usb_sndbulkpipe(udev, cport_out->endpoint),
+				  message->buffer, buffer_size,
+				  cport_out_callback, out);
+	}
+	urb_set_transfer_buffer(es1, urb, urb->transfer_buffer);
+	urb->sg = message->sg;
+	urb->num_sgs = message->num_sgs;
 	urb->transfer_flags |= URB_ZERO_PACKET;
 	trace_gb_host_device_send(hd, cport_id, buffer_size);
 	retval = usb_submit_urb(urb, gfp_mask);
 	if (retval) {
 		pr_err("error %d submitting URB\n", retval);
 
-		spin_lock_irqsave(&es1->cport_out_urb_lock, flags);
-		message->hcpriv = NULL;
-		spin_unlock_irqrestore(&es1->cport_out_urb_lock, flags);
-
-		free_urb(es1, urb);
+		atomic_dec(&es1->cport_traffic[cport_id].in_flight);
+		cport_out_urb_detach(es1, out);
+		free_urb(es1, out);
 		gb_message_cport_clear(message->header);
 
 		return retval;
@@ -464,157 +1779,142 @@ static int message_send(struct greybus_host_device *hd, u16 cport_id,
 }
 
 /*
- * Can not be called in atomic context.
+ * Returns zero if the message was successfully queued, or a negative errno
+ * otherwise.
  */
-static void message_cancel(struct gb_message *message)
+static int message_send(struct greybus_host_device *hd, u16 cport_id,
+			struct gb_message *message, gfp_t gfp_mask)
 {
-	struct greybus_host_device *hd = message->operation->connection->hd;
 	struct es1_ap_dev *es1 = hd_to_es1(hd);
-	struct urb *urb;
-	int i;
-
-	might_sleep();
-
-	spin_lock_irq(&es1->cport_out_urb_lock);
-	urb = message->hcpriv;
-
-	/* Prevent dynamically allocated urb from being deallocated. */
-	usb_get_urb(urb);
+	struct es1_cport_traffic *traffic;
+	int retval;
 
-	/* Prevent pre-allocated urb from being reused. */
-	for (i = 0; i < NUM_CPORT_OUT_URB; ++i) {
-		if (urb == es1->cport_out_urb[i]) {
-			es1->cport_out_urb_cancelled[i] = true;
-			break;
-		}
+	/*
+	 * The data actually transferred will include an indication
+	 * of where the data should be sent.  Do one last check of
+	 * the target CPort id before filling it in.
+	 */
+	if (!cport_id_valid(hd, cport_id)) {
+		pr_err("invalid destination cport 0x%02x\n", cport_id);
+		return -EINVAL;
 	}
-	spin_unlock_irq(&es1->cport_out_urb_lock);
 
-	usb_kill_urb(urb);
+	traffic = &es1->cport_traffic[cport_id];
+	atomic_add(gb_message_size(message), &traffic->bytes);
+	atomic_inc(&traffic->in_flight);
 
-	if (i < NUM_CPORT_OUT_URB) {
-		spin_lock_irq(&es1->cport_out_urb_lock);
-		es1->cport_out_urb_cancelled[i] = false;
-		spin_unlock_irq(&es1->cport_out_urb_lock);
+	/*
+	 * Either the cport is seen being moved, or the move sees this
+	 * message in flight and waits for it.  Pairs with the barrier in
+	 * ep_remap_begin().
+	 */
+	smp_mb();
+	if (unlikely(ACCESS_ONCE(traffic->remapping))) {
+		retval = ep_remap_defer(es1, cport_id, message, gfp_mask);
+		if (retval != -EAGAIN)
+			return retval;
 	}
 
-	usb_free_urb(urb);
-}
-
-static ssize_t cport_map_read(struct file *f, char __user *buf,
-				size_t count, loff_t *ppos)
-{
-	char tmp_buf[8];
-	struct es1_ap_dev *es1;
-	struct cport_to_ep *mapping;
-
-	mapping = (struct cport_to_ep *)f->f_inode->i_private;
-	es1 = container_of(mapping, struct direct_mapped_ep,
-				cport_to_ep[mapping->cport_id])->es1;
-
-	sprintf(tmp_buf, "%d\n", cport_to_ep_pair(es1, mapping->cport_id));
-	return simple_read_from_buffer(buf, count, ppos,
-					tmp_buf, strlen(tmp_buf) + 1);
+	return __message_send(es1, cport_id, message, gfp_mask);
 }
 
-static ssize_t cport_map_write(struct file *f, const char __user *buf,
-				size_t count, loff_t *ppos)
+/*
+ * Can not be called in atomic context.
+ */
+static void message_cancel(struct gb_message *message)
 {
-	int retval;
-	int ep_pair;
-	int old_ep_pair;
-	struct cport_to_ep *mapping;
-	struct es1_ap_dev *es1;
+	struct greybus_host_device *hd = message->operation->connection->hd;
+	struct es1_ap_dev *es1 = hd_to_es1(hd);
+	struct es1_cport_out_pack *pack;
+	struct es1_cport_out_urb *out;
+	struct urb *urb;
+	bool removed;
 
-	retval = kstrtoint_from_user(buf, count, 10, &ep_pair);
-	if (retval)
-		return retval;
+	might_sleep();
 
-	mapping = (struct cport_to_ep *)f->f_inode->i_private;
-	es1 = container_of(mapping, struct direct_mapped_ep,
-				cport_to_ep[mapping->cport_id])->es1;
+	/*
+	 * A message held back while its cport is moved is sent once the
+	 * move, done with the ep_map_mutex held, is over.
+	 */
+	if (ACCESS_ONCE(message->hcpriv) == &es1->ep_remap_deferred) {
+		mutex_lock(&es1->ep_map_mutex);
+		mutex_unlock(&es1->ep_map_mutex);
+	}
 
-	/* Ensure endpoints pair is not already mapped to a cport */
-	if (ep_pair && ep_pair_in_use(es1, ep_pair))
-		return -EINVAL;
+	out = ACCESS_ONCE(message->hcpriv);
+	if (!out)
+		return;
 
-	/* If the cport is already mapped, then unmap it */
-	old_ep_pair = cport_to_ep_pair(es1, mapping->cport_id);
-	if (old_ep_pair && ep_pair != old_ep_pair)
-		unmap_cport(es1, mapping->cport_id);
+	if (cport_out_urb_pooled(es1, out)) {
+		/*
+		 * Prevent pre-allocated urb from being reused, unless it
+		 * has already been detached from the message (and possibly
+		 * reused) by the time we get a reference to it.
+		 */
+		if (!atomic_inc_not_zero(&out->ref))
+			return;
+		if (ACCESS_ONCE(message->hcpriv) == out)
+			usb_kill_urb(out->urb);
+		cport_out_urb_put(es1, out);
+		return;
+	}
 
-	/* Map the cport to the endpoints pair requested by user */
-	retval = map_cport_to_ep(es1, mapping->cport_id, ep_pair);
-	if (retval)
-		return retval;
+	spin_lock_irq(&es1->cport_out_urb_lock);
+	out = message->hcpriv;
 
-	return count;
-}
+	/*
+	 * A packed message is taken out of its transfer, which is never
+	 * killed as it carries the messages of other operations too.
+	 */
+	if (out && !out->message) {
+		pack = container_of(out, struct es1_cport_out_pack, out);
+		removed = cport_out_pack_remove(pack, message);
+		spin_unlock_irq(&es1->cport_out_urb_lock);
+		if (removed)
+			greybus_message_sent(hd, message, -ENOENT);
+		return;
+	}
 
-static const struct file_operations cport_map_fops = {
-	.read	= cport_map_read,
-	.write	= cport_map_write,
-};
+	urb = out ? out->urb : NULL;
 
-static void debugfs_connection_create(struct gb_connection *connection)
-{
-	struct greybus_host_device *hd = connection->hd;
-	struct es1_ap_dev *es1 = hd_to_es1(hd);
-	struct dentry *parent;
-	u8 intf_id;
+	/* Prevent dynamically allocated urb from being deallocated. */
+	usb_get_urb(urb);
+	spin_unlock_irq(&es1->cport_out_urb_lock);
 
-	intf_id = connection->bundle->intf->interface_id;
-	parent = gb_debugfs_cport_create(connection, intf_id);
-	debugfs_create_file("ep_set", (S_IWUSR | S_IRUGO), parent,
-			get_mapped_ep(es1, connection->hd_cport_id),
-			&cport_map_fops);
+	usb_kill_urb(urb);
+	usb_free_urb(urb);
 }
 
-/*
- * Simple cport to endpoints mapping policy.
- * Map cport to dedicated endpoints in order of connection creation,
- * if the cport is used for loopback protocol.
- * Fallback to muxed endpoints when all dedicated endpoints are allocated.
- */
-static void connection_create(struct gb_connection *connection)
+/* Move a cport back to the muxed endpoints pair when it is disabled */
+static int cport_disable(struct greybus_host_device *hd, u16 cport_id)
 {
-	struct greybus_host_device *hd = connection->hd;
 	struct es1_ap_dev *es1 = hd_to_es1(hd);
-	int ep_pair;
+	struct es1_cport_traffic *traffic = &es1->cport_traffic[cport_id];
 	int retval;
 
-	debugfs_connection_create(connection);
-
-	/* Map cport to endpoints pair only for loopback protocol */
-	if (connection->protocol_id != GREYBUS_PROTOCOL_LOOPBACK)
-		return;
-
-	/*
-	 * Try to get an unmapped endpoints pair.
-	 * Fallback to muxed endpoints pair in case of error.
-	 */
-	ep_pair = find_first_unmapped_ep_pair(es1);
-	retval = map_cport_to_ep(es1, connection->hd_cport_id, ep_pair);
+	mutex_lock(&es1->ep_map_mutex);
+	retval = unmap_cport(es1, cport_id);
 	if (retval)
 		dev_err(&es1->usb_dev->dev,
-			"Can not map cport to dedicated endpoints\n");
-}
-
-static void connection_destroy(struct gb_connection *connection)
-{
-	struct greybus_host_device *hd = connection->hd;
-	struct es1_ap_dev *es1 = hd_to_es1(hd);
+			"Can not unmap cport %hu from dedicated endpoints: %d\n",
+			cport_id, retval);
+	atomic_set(&traffic->bytes, 0);
+	traffic->rate = 0;
+	traffic->idle = 0;
+	mutex_unlock(&es1->ep_map_mutex);
 
-	unmap_cport(es1, connection->hd_cport_id);
-	gb_debugfs_cport_destroy(connection);
+	return retval;
 }
 
 static struct greybus_host_driver es1_driver = {
 	.hd_priv_size		= sizeof(struct es1_ap_dev),
-	.connection_create	= connection_create,
-	.connection_destroy	= connection_destroy,
+	.cport_disable		= cport_disable,
 	.message_send		= message_send,
 	.message_cancel		= message_cancel,
+	.buffer_free		= buffer_free,
+	.message_buffer_alloc	= message_buffer_alloc,
+	.message_buffer_free	= message_buffer_free,
+	.hd_release		= hd_release,
 };
 
 /* Common function to report consistent warnings based on URB status */
@@ -645,6 +1945,7 @@ static int check_urb_status(struct urb *urb)
 
 static void ap_disconnect(struct usb_interface *interface)
 {
+	struct greybus_host_device *hd;
 	struct es1_ap_dev *es1;
 	struct usb_device *udev;
 	int bulk_in;
@@ -654,55 +1955,129 @@ static void ap_disconnect(struct usb_interface *interface)
 	if (!es1)
 		return;
 
+	/* Keep es1 around past greybus_remove_hd() */
+	hd = es1->hd;
+	gb_hd_get(hd);
+
 	usb_log_disable(es1);
 
 	/* Tear down everything! */
-	for (i = 0; i < NUM_CPORT_OUT_URB; ++i) {
-		struct urb *urb = es1->cport_out_urb[i];
+	cancel_delayed_work_sync(&es1->urb_pool_work);
+	cancel_delayed_work_sync(&es1->ep_map_work);
+
+	/* Stop packing, and send what was waiting to be packed */
+	for (i = 0; i < NUM_BULKS; i++) {
+		struct es1_cport_out *cport_out = &es1->cport_out[i];
+
+		spin_lock_irq(&cport_out->pack_lock);
+		cport_out->packing = false;
+		spin_unlock_irq(&cport_out->pack_lock);
+
+		hrtimer_cancel(&cport_out->pack_timer);
+		cport_out_pack_flush(cport_out);
+		usb_kill_anchored_urbs(&cport_out->pack_anchor);
+		cport_out_packs_free(cport_out);
+	}
+
+	/*
+	 * Messages are still sent while greybus_remove_hd() disables the
+	 * connections; they get dynamically allocated urbs once the pool is
+	 * gone.  Emptied slots are kept busy, as the kill may have freed them.
+	 */
+	for (i = 0; i < NUM_CPORT_OUT_URB_MAX; ++i) {
+		struct urb *urb = es1->cport_out_urb[i].urb;
 
 		if (!urb)
-			break;
+			continue;
+		ACCESS_ONCE(es1->cport_out_urb[i].urb) = NULL;
 		usb_kill_urb(urb);
+		set_bit(i, es1->cport_out_urb_busy);
 		usb_free_urb(urb);
-		es1->cport_out_urb[i] = NULL;
-		es1->cport_out_urb_busy[i] = false;	/* just to be anal */
 	}
 
+	/*
+	 * The urbs free themselves once killed, but one being completed
+	 * may be resubmitted after its endpoint has been swept.
+	 */
 	for (bulk_in = 0; bulk_in < NUM_BULKS; bulk_in++) {
 		struct es1_cport_in *cport_in = &es1->cport_in[bulk_in];
-		for (i = 0; i < NUM_CPORT_IN_URB; ++i) {
-			struct urb *urb = cport_in->urb[i];
-
-			if (!urb)
-				break;
-			usb_kill_urb(urb);
-			usb_free_urb(urb);
-			kfree(cport_in->buffer[i]);
-			cport_in->buffer[i] = NULL;
-		}
+
+		ACCESS_ONCE(cport_in->target) = 0;
+		while (atomic_read(&cport_in->urbs))
+			usb_kill_anchored_urbs(&cport_in->anchor);
 	}
 
 	usb_set_intfdata(interface, NULL);
 	udev = es1->usb_dev;
-	greybus_remove_hd(es1->hd);
+	greybus_remove_hd(hd);
+	cport_in_buffers_free(es1);
+	es1_dma_pool_destroy(es1, &es1->transfer_pool);
 	direct_mapped_ep_free(es1->mapped_ep);
+	kfree(es1->cport_traffic);
 
 	usb_put_dev(udev);
+	gb_hd_put(hd);
+}
+
+/*
+ * Hand each message of a bulk in transfer holding several of them to the
+ * greybus core.  The messages are copied, as the buffer can only be loaned
+ * once.
+ */
+static void cport_in_unpack(struct es1_ap_dev *es1, struct urb *urb)
+{
+	struct greybus_host_device *hd = es1->hd;
+	struct device *dev = &urb->dev->dev;
+	struct gb_operation_msg_hdr *header;
+	size_t offset = 0;
+	size_t size;
+	u16 cport_id;
+
+	while (urb->actual_length - offset >= sizeof(*header)) {
+		header = urb->transfer_buffer + offset;
+		size = le16_to_cpu(header->size);
+		if (size < sizeof(*header) ||
+		    size > urb->actual_length - offset) {
+			dev_err(dev, "%s: bad packed message size %zu\n",
+				__func__, size);
+			return;
+		}
+
+		cport_id = gb_message_cport_unpack(header);
+		if (cport_id_valid(hd, cport_id)) {
+			trace_gb_host_device_recv(hd, cport_id, size);
+			atomic_add(size, &es1->cport_traffic[cport_id].bytes);
+			greybus_data_rcvd(hd, cport_id, (u8 *)header, size);
+		} else {
+			dev_err(dev, "%s: invalid cport id 0x%02x received\n",
+				__func__, cport_id);
+		}
+
+		offset = ALIGN(offset + size, PACK_ALIGN);
+	}
 }
 
 static void cport_in_callback(struct urb *urb)
 {
-	struct greybus_host_device *hd = urb->context;
+	struct es1_cport_in *cport_in = urb->context;
+	struct es1_ap_dev *es1 = cport_in->es1;
+	struct greybus_host_device *hd = es1->hd;
 	struct device *dev = &urb->dev->dev;
 	struct gb_operation_msg_hdr *header;
 	int status = check_urb_status(urb);
+	void *buffer;
 	int retval;
 	u16 cport_id;
 
+	/* Nothing is left to receive data in until this urb is resubmitted */
+	if (atomic_dec_and_test(&cport_in->queued))
+		atomic_inc(&cport_in->starved);
+
 	if (status) {
 		if ((status == -EAGAIN) || (status == -EPROTO))
 			goto exit;
 		dev_err(dev, "urb cport in error %d (dropped)\n", status);
+		cport_in_urb_free(cport_in, urb);
 		return;
 	}
 
@@ -713,37 +2088,63 @@ static void cport_in_callback(struct urb *urb)
 
 	/* Extract the CPort id, which is packed in the message header */
 	header = urb->transfer_buffer;
+	if (es1->packing && le16_to_cpu(header->size) < urb->actual_length) {
+		cport_in_unpack(es1, urb);
+		goto exit;
+	}
 	cport_id = gb_message_cport_unpack(header);
 
 	if (cport_id_valid(hd, cport_id)) {
 		trace_gb_host_device_recv(hd, cport_id, urb->actual_length);
-		greybus_data_rcvd(hd, cport_id, urb->transfer_buffer,
+		atomic_add(urb->actual_length,
+			   &es1->cport_traffic[cport_id].bytes);
+
+		/*
+		 * Loan the buffer to the core if we have a replacement for
+		 * it, and copy the data otherwise.
+		 */
+		buffer = cport_in_buffer_get(es1);
+		if (!buffer) {
+			greybus_data_rcvd(hd, cport_id, urb->transfer_buffer,
 							urb->actual_length);
+		} else if (greybus_data_rcvd_loan(hd, cport_id,
+						  urb->transfer_buffer,
+						  urb->actual_length)) {
+			urb_set_transfer_buffer(es1, urb, buffer);
+		} else {
+			buffer_free(hd, buffer);
+		}
 	} else {
 		dev_err(dev, "%s: invalid cport id 0x%02x received\n",
 				__func__, cport_id);
 	}
 exit:
+	if (cport_in_urb_excess(cport_in)) {
+		cport_in_urb_release(cport_in, urb);
+		return;
+	}
+
 	/* put our urb back in the request pool */
-	retval = usb_submit_urb(urb, GFP_ATOMIC);
-	if (retval)
+	retval = cport_in_urb_submit(cport_in, urb, GFP_ATOMIC);
+	if (retval) {
 		dev_err(dev, "%s: error %d in submitting urb.\n",
 			__func__, retval);
+		cport_in_urb_free(cport_in, urb);
+	}
 }
 
 static void cport_out_callback(struct urb *urb)
 {
-	struct gb_message *message = urb->context;
+	struct es1_cport_out_urb *out = urb->context;
+	struct gb_message *message = out->message;
 	struct greybus_host_device *hd = message->operation->connection->hd;
 	struct es1_ap_dev *es1 = hd_to_es1(hd);
 	int status = check_urb_status(urb);
-	unsigned long flags;
 
 	gb_message_cport_clear(message->header);
 
-	spin_lock_irqsave(&es1->cport_out_urb_lock, flags);
-	message->hcpriv = NULL;
-	spin_unlock_irqrestore(&es1->cport_out_urb_lock, flags);
+	atomic_dec(&es1->cport_traffic[out->cport_id].in_flight);
+	cport_out_urb_detach(es1, out);
 
 	/*
 	 * Tell the submitter that the message send (attempt) is
@@ -751,7 +2152,7 @@ static void cport_out_callback(struct urb *urb)
 	 */
 	greybus_message_sent(hd, message, status);
 
-	free_urb(es1, urb);
+	free_urb(es1, out);
 }
 
 #define APB1_LOG_MSG_SIZE	64
@@ -879,6 +2280,87 @@ static const struct file_operations apb1_log_enable_fops = {
 	.write	= apb1_log_enable_write,
 };
 
+static int urb_pools_show(struct seq_file *s, void *unused)
+{
+	struct es1_ap_dev *es1 = s->private;
+	struct es1_cport_in *cport_in;
+	int bulk_in;
+
+	seq_printf(s, "out: urbs %u (min %u max %u peak %u) in use %d fallbacks %d\n",
+		   es1->cport_out_urbs, es1->cport_out_urbs_min,
+		   es1->cport_out_urbs_max, es1->cport_out_urbs_peak,
+		   atomic_read(&es1->cport_out_urb_in_use),
+		   atomic_read(&es1->cport_out_urb_fallbacks));
+	seq_printf(s, "packing %s: packs %d messages %d\n",
+		   es1->packing ? "on" : "off", atomic_read(&es1->packs),
+		   atomic_read(&es1->packed_messages));
+	seq_printf(s, "dma: transfer buffers %u/%u message buffers %u/%u\n",
+		   es1_dma_pool_in_use(&es1->transfer_pool),
+		   es1->transfer_pool.count,
+		   es1_dma_pool_in_use(&es1->message_pool),
+		   es1->message_pool.count);
+
+	for (bulk_in = 0; bulk_in < NUM_BULKS; bulk_in++) {
+		cport_in = &es1->cport_in[bulk_in];
+		seq_printf(s, "in%d: urbs %d target %u (min %u max %u peak %u) queued %d starved %d\n",
+			   bulk_in, atomic_read(&cport_in->urbs),
+			   cport_in->target, es1->cport_in_urbs_min,
+			   es1->cport_in_urbs_max, cport_in->urbs_peak,
+			   atomic_read(&cport_in->queued),
+			   atomic_read(&cport_in->starved));
+	}
+
+	return 0;
+}
+
+static int urb_pools_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, urb_pools_show, inode->i_private);
+}
+
+static const struct file_operations urb_pools_fops = {
+	.open		= urb_pools_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static int cport_map_show(struct seq_file *s, void *unused)
+{
+	struct es1_ap_dev *es1 = s->private;
+	int ep_pair;
+	u16 cport_id;
+
+	mutex_lock(&es1->ep_map_mutex);
+	seq_printf(s, "maps %u unmaps %u failures %u\n", es1->ep_maps,
+		   es1->ep_unmaps, es1->ep_map_failures);
+
+	for (cport_id = 0; cport_id < es1->hd->num_cports; cport_id++) {
+		ep_pair = cport_to_ep_pair(es1, cport_id);
+		if (ep_pair == MUXED_EP_PAIR)
+			continue;
+
+		seq_printf(s, "cport %hu: endpoints pair %d rate %u B/s\n",
+			   cport_id, ep_pair,
+			   es1->cport_traffic[cport_id].rate);
+	}
+	mutex_unlock(&es1->ep_map_mutex);
+
+	return 0;
+}
+
+static int cport_map_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, cport_map_show, inode->i_private);
+}
+
+static const struct file_operations cport_map_fops = {
+	.open		= cport_map_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
 static int apb1_get_cport_count(struct usb_device *udev)
 {
 	int retval;
@@ -912,6 +2394,26 @@ out:
 	return retval;
 }
 
+/*
+ * Ask APBridge to pack messages in bulk transfers, with wValue the alignment
+ * of the messages in a transfer.  Bridges which do not support it stall the
+ * request.
+ */
+static int apb1_packing_enable(struct usb_device *udev)
+{
+	int retval;
+
+	retval = usb_control_msg(udev, usb_sndctrlpipe(udev, 0),
+				 REQUEST_PACKING,
+				 USB_DIR_OUT | USB_TYPE_VENDOR |
+				 USB_RECIP_INTERFACE, PACK_ALIGN, 0, NULL, 0,
+				 ES1_TIMEOUT);
+	if (retval < 0)
+		return retval;
+
+	return 0;
+}
+
 /*
  * The ES1 USB Bridge device contains 4 endpoints
  * 1 Control - usual USB stuff + AP -> SVC messages
@@ -954,15 +2456,68 @@ static int ap_probe(struct usb_interface *interface,
 	es1->hd = hd;
 	es1->usb_intf = interface;
 	es1->usb_dev = udev;
+	usb_get_dev(udev);	/* for the message pool, see hd_release() */
+
+#ifdef USB_HAVE_NO_SG_CONSTRAINT
+	/* Message headers are not max-packet aligned, so check for support */
+	if (udev->bus->no_sg_constraint)
+		hd->sg_tablesize = udev->bus->sg_tablesize;
+#endif
 	spin_lock_init(&es1->cport_out_urb_lock);
+	spin_lock_init(&es1->cport_in_buffer_lock);
+	INIT_DELAYED_WORK(&es1->urb_pool_work, urb_pool_work);
+	INIT_DELAYED_WORK(&es1->ep_map_work, ep_map_work);
+	mutex_init(&es1->ep_map_mutex);
+	INIT_LIST_HEAD(&es1->ep_remap_deferred);
+	for (bulk_in = 0; bulk_in < NUM_BULKS; bulk_in++) {
+		es1->cport_in[bulk_in].es1 = es1;
+		init_usb_anchor(&es1->cport_in[bulk_in].anchor);
+	}
+	for (bulk_out = 0; bulk_out < NUM_BULKS; bulk_out++) {
+		struct es1_cport_out *cport_out = &es1->cport_out[bulk_out];
+
+		cport_out->es1 = es1;
+		spin_lock_init(&cport_out->pack_lock);
+		INIT_LIST_HEAD(&cport_out->pack_free);
+		hrtimer_init(&cport_out->pack_timer, CLOCK_MONOTONIC,
+			     HRTIMER_MODE_REL);
+		cport_out->pack_timer.function = cport_out_pack_timer;
+		init_usb_anchor(&cport_out->pack_anchor);
+	}
+	bulk_out = 0;
+	bulk_in = 0;
 	usb_set_intfdata(interface, es1);
 
+	es1->cport_in_urbs_max = clamp_t(unsigned int, cport_in_urbs_max,
+					 1, NUM_CPORT_IN_URB_MAX);
+	es1->cport_in_urbs_min = clamp_t(unsigned int, cport_in_urbs_min,
+					 1, es1->cport_in_urbs_max);
+	es1->cport_out_urbs_max = clamp_t(unsigned int, cport_out_urbs_max,
+					  1, NUM_CPORT_OUT_URB_MAX);
+	es1->cport_out_urbs_min = clamp_t(unsigned int, cport_out_urbs_min,
+					  1, es1->cport_out_urbs_max);
+
 	es1->mapped_ep = direct_mapped_ep_alloc(es1, hd->num_cports);
 	if (!es1->mapped_ep) {
 		retval = -ENOMEM;
 		goto error;
 	}
 
+	es1->cport_traffic = kcalloc(hd->num_cports,
+				     sizeof(*es1->cport_traffic), GFP_KERNEL);
+	if (!es1->cport_traffic) {
+		retval = -ENOMEM;
+		goto error;
+	}
+
+	/* Buffers are kmalloc()ed instead if coherent memory is short */
+	if (es1_dma_pool_create(es1, &es1->transfer_pool,
+				dma_transfer_buffers, ES1_GBUF_MSG_SIZE_MAX))
+		dev_warn(&udev->dev, "no coherent transfer buffers\n");
+	if (es1_dma_pool_create(es1, &es1->message_pool,
+				dma_message_buffers, DMA_MESSAGE_BUFFER_SIZE))
+		dev_warn(&udev->dev, "no coherent message buffers\n");
+
 	/* find all 3 of our endpoints */
 	iface_desc = interface->cur_altsetting;
 	for (i = 0; i < iface_desc->desc.bNumEndpoints; ++i) {
@@ -986,28 +2541,32 @@ static int ap_probe(struct usb_interface *interface,
 		goto error;
 	}
 
+	/* Before any bulk in transfer can hold several messages */
+	if (pack_window_us) {
+		retval = apb1_packing_enable(udev);
+		if (retval) {
+			dev_dbg(&udev->dev, "APBridge does not pack messages: %d\n",
+				retval);
+		} else {
+			es1->packing = true;
+			for (i = 0; i < NUM_BULKS; i++) {
+				retval = cport_out_packs_alloc(&es1->cport_out[i]);
+				if (retval)
+					goto error;
+				es1->cport_out[i].packing = true;
+			}
+		}
+	}
+
 	/* Allocate buffers for our cport in messages and start them up */
 	for (bulk_in = 0; bulk_in < NUM_BULKS; bulk_in++) {
 		struct es1_cport_in *cport_in = &es1->cport_in[bulk_in];
-		for (i = 0; i < NUM_CPORT_IN_URB; ++i) {
-			struct urb *urb;
-			u8 *buffer;
-
-			urb = usb_alloc_urb(0, GFP_KERNEL);
-			if (!urb)
-				goto error;
-			buffer = kmalloc(ES1_GBUF_MSG_SIZE_MAX, GFP_KERNEL);
-			if (!buffer)
-				goto error;
 
-			usb_fill_bulk_urb(urb, udev,
-					  usb_rcvbulkpipe(udev,
-							  cport_in->endpoint),
-					  buffer, ES1_GBUF_MSG_SIZE_MAX,
-					  cport_in_callback, hd);
-			cport_in->urb[i] = urb;
-			cport_in->buffer[i] = buffer;
-			retval = usb_submit_urb(urb, GFP_KERNEL);
+		cport_in->target = clamp_t(unsigned int, NUM_CPORT_IN_URB,
+					   es1->cport_in_urbs_min,
+					   es1->cport_in_urbs_max);
+		for (i = 0; i < cport_in->target; ++i) {
+			retval = cport_in_urb_add(cport_in);
 			if (retval)
 				goto error;
 		}
@@ -1021,21 +2580,26 @@ static int ap_probe(struct usb_interface *interface,
 		muxed_ep_init(es1, i);
 
 	/* Allocate urbs for our CPort OUT messages */
-	for (i = 0; i < NUM_CPORT_OUT_URB; ++i) {
-		struct urb *urb;
-
-		urb = usb_alloc_urb(0, GFP_KERNEL);
-		if (!urb)
-			goto error;
-
-		es1->cport_out_urb[i] = urb;
-		es1->cport_out_urb_busy[i] = false;	/* just to be anal */
+	bitmap_fill(es1->cport_out_urb_busy, NUM_CPORT_OUT_URB_MAX);
+	cport_out_pool_grow(es1, clamp_t(unsigned int, NUM_CPORT_OUT_URB,
+					 es1->cport_out_urbs_min,
+					 es1->cport_out_urbs_max));
+	if (es1->cport_out_urbs < es1->cport_out_urbs_min) {
+		retval = -ENOMEM;
+		goto error;
 	}
 
+	schedule_delayed_work(&es1->urb_pool_work, URB_POOL_PERIOD);
+	schedule_delayed_work(&es1->ep_map_work, EP_MAP_PERIOD);
+
 	apb1_log_enable_dentry = debugfs_create_file("apb1_log_enable",
 							(S_IWUSR | S_IRUGO),
 							gb_debugfs_get(), es1,
 							&apb1_log_enable_fops);
+	debugfs_create_file("urb_pools", S_IRUGO, hd->dentry, es1,
+			    &urb_pools_fops);
+	debugfs_create_file("cport_map", S_IRUGO, hd->dentry, es1,
+			    &cport_map_fops);
 	return 0;
 error:
 	ap_disconnect(interface);
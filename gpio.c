@@ -155,9 +155,11 @@ static int gb_gpio_get_value_operation(struct gb_gpio_controller *ggc,
 	u8 value;
 
 	request.which = which;
-	ret = gb_operation_sync(ggc->connection, GB_GPIO_TYPE_GET_VALUE,
+	ret = gb_operation_sync_timeout(ggc->connection,
+				GB_GPIO_TYPE_GET_VALUE,
 				&request, sizeof(request),
-				&response, sizeof(response));
+				&response, sizeof(response),
+				GB_OPERATION_TIMEOUT_ADAPTIVE);
 	if (ret) {
 		dev_err(ggc->chip.dev, "failed to get value of gpio %u\n",
 			which);
@@ -188,8 +190,10 @@ static void gb_gpio_set_value_operation(struct gb_gpio_controller *ggc,
 
 	request.which = which;
 	request.value = value_high ? 1 : 0;
-	ret = gb_operation_sync(ggc->connection, GB_GPIO_TYPE_SET_VALUE,
-				&request, sizeof(request), NULL, 0);
+	ret = gb_operation_sync_timeout(ggc->connection,
+				GB_GPIO_TYPE_SET_VALUE,
+				&request, sizeof(request), NULL, 0,
+				GB_OPERATION_TIMEOUT_ADAPTIVE);
 	if (ret) {
 		dev_err(ggc->chip.dev, "failed to set value of gpio %u\n",
 			which);
@@ -19,6 +19,7 @@
 #include <linux/device.h>
 #include <linux/module.h>
 #include <linux/idr.h>
+#include <linux/workqueue.h>
 
 #include "kernel_ver.h"
 #include "greybus_id.h"
@@ -80,6 +81,25 @@ struct greybus_host_driver {
 	int (*message_send)(struct greybus_host_device *hd, u16 dest_cport_id,
 			struct gb_message *message, gfp_t gfp_mask);
 	void (*message_cancel)(struct gb_message *message);
+	void (*buffer_free)(struct greybus_host_device *hd, void *buffer);
+
+	/*
+	 * Optional: a buffer of at least @size bytes for an outbound
+	 * message, or NULL to let the core allocate one.  It is handed back
+	 * through message_buffer_free (never buffer_free), and the host
+	 * device is kept around until it has been.
+	 */
+	void *(*message_buffer_alloc)(struct greybus_host_device *hd,
+				      size_t size, gfp_t gfp_mask);
+	void (*message_buffer_free)(struct greybus_host_device *hd,
+				    void *buffer);
+
+	/*
+	 * Optional: release what the driver keeps for the whole lifetime of
+	 * the host device.  Called in process context once the last
+	 * reference to it is gone.
+	 */
+	void (*hd_release)(struct greybus_host_device *hd);
 };
 
 struct greybus_host_device {
@@ -90,6 +110,9 @@ struct greybus_host_device {
 	struct list_head interfaces;
 	struct list_head connections;
 	struct ida cport_id_map;
+
+	/* Connections indexed by host CPort id, for the receive path */
+	struct gb_connection __rcu **cport_connections;
 	u8 device_id;
 
 	/* Number of CPorts supported by the UniPro IP */
@@ -98,10 +121,21 @@ struct greybus_host_device {
 	/* Host device buffer constraints */
 	size_t buffer_size_max;
 
+	/*
+	 * Maximum number of scatter-gather entries of an outbound message, or
+	 * 0 if the host device can only send linear message buffers.
+	 */
+	unsigned int sg_tablesize;
+
 	struct gb_endo *endo;
 	struct gb_connection *initial_svc_connection;
 	struct gb_svc *svc;
 
+	struct list_head debugfs_links;
+	struct dentry *dentry;
+
+	struct work_struct release_work;
+
 	/* Private data for the host driver */
 	unsigned long hd_priv[0] __aligned(sizeof(s64));
 };
@@ -113,6 +147,8 @@ struct greybus_host_device *greybus_create_hd(struct greybus_host_driver *hd,
 int greybus_endo_setup(struct greybus_host_device *hd, u16 endo_id,
 			u8 ap_intf_id);
 void greybus_remove_hd(struct greybus_host_device *hd);
+void gb_hd_get(struct greybus_host_device *hd);
+void gb_hd_put(struct greybus_host_device *hd);
 
 struct greybus_driver {
 	const char *name;
@@ -160,6 +196,8 @@ struct dentry *gb_debugfs_get(void);
 struct dentry *gb_debugfs_cport_create(struct gb_connection *connection,
 					u8 intf_id);
 void gb_debugfs_cport_destroy(struct gb_connection *connection);
+void gb_debugfs_hd_create(struct greybus_host_device *hd);
+void gb_debugfs_hd_destroy(struct greybus_host_device *hd);
 
 extern struct bus_type greybus_bus_type;
 
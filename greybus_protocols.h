@@ -89,6 +89,13 @@
  * The wire format for all numeric fields in the header is little
  * endian.  Any operation-specific data begins immediately after the
  * header.
+ *
+ * If message fragmentation has been negotiated for a connection (see
+ * GB_CONTROL_TYPE_FRAGMENTATION), a message too big for the transport
+ * is sent as a sequence of fragments.  Every fragment carries a copy of
+ * the message header, with the size field describing the fragment, and
+ * the next part of the payload.  All fragments but the last one have
+ * GB_OPERATION_MSG_FLAG_MORE set in their second pad byte.
  */
 struct gb_operation_msg_hdr {
 	__le16	size;		/* Size in bytes of header + payload */
@@ -98,6 +105,9 @@ struct gb_operation_msg_hdr {
 	__u8	pad[2];		/* must be zero (ignore when read) */
 } __packed;
 
+/* Fragment flags, in pad[1] of the operation message header */
+#define GB_OPERATION_MSG_FLAG_MORE		0x01
+
 
 /* Generic request numbers supported by all modules */
 #define GB_REQUEST_TYPE_INVALID			0x00
@@ -125,6 +135,7 @@ struct gb_protocol_version_response {
 #define GB_CONTROL_TYPE_GET_MANIFEST		0x04
 #define GB_CONTROL_TYPE_CONNECTED		0x05
 #define GB_CONTROL_TYPE_DISCONNECTED		0x06
+#define GB_CONTROL_TYPE_FRAGMENTATION		0x07
 
 /* Control protocol manifest get size request has no payload*/
 struct gb_control_get_manifest_size_response {
@@ -146,6 +157,16 @@ struct gb_control_disconnected_request {
 } __packed;
 /* Control protocol [dis]connected response has no payload */
 
+/* Control protocol fragmentation request and response */
+struct gb_control_fragmentation_request {
+	__le16			cport_id;
+	__le16			size_max;
+} __packed;
+
+struct gb_control_fragmentation_response {
+	__le16			size_max;
+} __packed;
+
 
 /* Firmware Protocol */
 
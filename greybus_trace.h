@@ -12,9 +12,11 @@
 #if !defined(_TRACE_GREYBUS_H) || defined(TRACE_HEADER_MULTI_READ)
 #define _TRACE_GREYBUS_H
 
+#include <linux/ktime.h>
 #include <linux/tracepoint.h>
 
 struct gb_message;
+struct gb_operation;
 struct greybus_host_device;
 
 DECLARE_EVENT_CLASS(gb_message,
@@ -106,6 +108,118 @@ DEFINE_EVENT(gb_message, gb_message_cancel_incoming,
 	TP_ARGS(message)
 );
 
+/*
+ * Operation lifecycle events.  The elapsed time is measured from the
+ * creation of the operation (or its reuse, for pooled incoming ones).
+ */
+DECLARE_EVENT_CLASS(gb_operation,
+
+	TP_PROTO(struct gb_operation *operation),
+
+	TP_ARGS(operation),
+
+	TP_STRUCT__entry(
+		__string(name, dev_name(&operation->connection->dev))
+		__field(u16, op_id)
+		__field(u8, type)
+		__field(u16, hd_cport_id)
+		__field(unsigned long, flags)
+		__field(int, errno)
+		__field(s64, elapsed_us)
+	),
+
+	TP_fast_assign(
+		__assign_str(name, dev_name(&operation->connection->dev))
+		__entry->op_id = operation->id;
+		__entry->type = operation->type;
+		__entry->hd_cport_id = operation->connection->hd_cport_id;
+		__entry->flags = operation->flags;
+		__entry->errno = operation->errno;
+		__entry->elapsed_us = ktime_us_delta(ktime_get(),
+						     operation->created);
+	),
+
+	TP_printk("greybus:%s op=%04x type=%02x hd_id=%04x flags=%lx errno=%d t=%lldus",
+		  __get_str(name), __entry->op_id, __entry->type,
+		  __entry->hd_cport_id, __entry->flags, __entry->errno,
+		  __entry->elapsed_us)
+);
+
+/*
+ * tracepoint name	greybus:gb_operation_create
+ * description		create a greybus operation
+ * location		operation.c:gb_operation_create_common,
+ *			operation.c:gb_operation_create_incoming
+ */
+DEFINE_EVENT(gb_operation, gb_operation_create,
+
+	TP_PROTO(struct gb_operation *operation),
+
+	TP_ARGS(operation)
+);
+
+/*
+ * tracepoint name	greybus:gb_operation_send
+ * description		hand a request or response to the host device
+ * location		operation.c:gb_operation_request_send,
+ *			operation.c:gb_operation_response_send
+ */
+DEFINE_EVENT(gb_operation, gb_operation_send,
+
+	TP_PROTO(struct gb_operation *operation),
+
+	TP_ARGS(operation)
+);
+
+/*
+ * tracepoint name	greybus:gb_operation_sent
+ * description		host device is done sending a request or response
+ * location		operation.c:greybus_message_sent
+ */
+DEFINE_EVENT(gb_operation, gb_operation_sent,
+
+	TP_PROTO(struct gb_operation *operation),
+
+	TP_ARGS(operation)
+);
+
+/*
+ * tracepoint name	greybus:gb_operation_response
+ * description		match a received response to its operation
+ * location		operation.c:gb_connection_recv_response
+ */
+DEFINE_EVENT(gb_operation, gb_operation_response,
+
+	TP_PROTO(struct gb_operation *operation),
+
+	TP_ARGS(operation)
+);
+
+/*
+ * tracepoint name	greybus:gb_operation_callback
+ * description		start handling a request or completing an operation
+ * location		operation.c:gb_operation_work,
+ *			operation.c:gb_operation_complete
+ */
+DEFINE_EVENT(gb_operation, gb_operation_callback,
+
+	TP_PROTO(struct gb_operation *operation),
+
+	TP_ARGS(operation)
+);
+
+/*
+ * tracepoint name	greybus:gb_operation_destroy
+ * description		destroy a greybus operation
+ * location		operation.c:_gb_operation_destroy
+ */
+DEFINE_EVENT(gb_operation, gb_operation_destroy,
+
+	TP_PROTO(struct gb_operation *operation),
+
+	TP_ARGS(operation)
+);
+
 DECLARE_EVENT_CLASS(gb_host_device,
 
 	TP_PROTO(struct greybus_host_device *hd, u16 intf_cport_id,
@@ -135,6 +135,15 @@ static inline void sysfs_remove_groups(struct kobject *kobj,
 }
 #endif
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 14, 0)
+/*
+ * Since this version the usb core knows whether a host controller can handle
+ * scatter-gather entries whose length is not a multiple of the max packet
+ * size.
+ */
+#define USB_HAVE_NO_SG_CONSTRAINT
+#endif
+
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 15, 0)
 #define MMC_HS400_SUPPORTED
 #define MMC_DDR52_DEFINED
@@ -289,4 +298,16 @@ static inline bool led_sysfs_is_disabled(struct led_classdev *led_cdev)
 #include <media/v4l2-flash-led-class.h>
 #endif
 
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 4, 0)
+/*
+ * gfpflags_allow_blocking() came in with the split of __GFP_WAIT into
+ * __GFP_DIRECT_RECLAIM and __GFP_KSWAPD_RECLAIM.
+ */
+#include <linux/gfp.h>
+static inline bool gfpflags_allow_blocking(const gfp_t gfp_flags)
+{
+	return !!(gfp_flags & __GFP_WAIT);
+}
+#endif
+
 #endif	/* __GREYBUS_KERNEL_VER_H */
@@ -862,32 +862,62 @@ static void gb_lights_channel_unregister(struct gb_channel *channel)
 		__gb_lights_flash_led_unregister(channel);
 }
 
-static int gb_lights_channel_config(struct gb_light *light,
-				    struct gb_channel *channel)
+/*
+ * Fetch the configurations of all the channels of a light, in a single batch
+ * of operations.
+ */
+static int gb_lights_channel_configs_get(struct gb_light *light,
+			struct gb_lights_get_channel_config_response *confs)
 {
-	struct gb_lights_get_channel_config_response conf;
-	struct gb_lights_get_channel_config_request req;
 	struct gb_connection *connection = get_conn_from_light(light);
-	struct led_classdev *cdev = get_channel_cdev(channel);
-	char *name;
+	struct gb_lights_get_channel_config_request *reqs;
+	struct gb_operation_batch *batch;
 	int ret;
+	int i;
 
-	req.light_id = light->id;
-	req.channel_id = channel->id;
+	reqs = kcalloc(light->channels_count, sizeof(*reqs), GFP_KERNEL);
+	batch = kcalloc(light->channels_count, sizeof(*batch), GFP_KERNEL);
+	if (!reqs || !batch) {
+		ret = -ENOMEM;
+		goto out;
+	}
 
-	ret = gb_operation_sync(connection, GB_LIGHTS_TYPE_GET_CHANNEL_CONFIG,
-				&req, sizeof(req), &conf, sizeof(conf));
-	if (ret < 0)
-		return ret;
+	for (i = 0; i < light->channels_count; i++) {
+		reqs[i].light_id = light->id;
+		reqs[i].channel_id = i;
+
+		batch[i].type = GB_LIGHTS_TYPE_GET_CHANNEL_CONFIG;
+		batch[i].request = &reqs[i];
+		batch[i].request_size = sizeof(reqs[i]);
+		batch[i].response = &confs[i];
+		batch[i].response_size = sizeof(confs[i]);
+	}
+
+	ret = gb_operation_sync_batch(connection, batch,
+				      light->channels_count);
+out:
+	kfree(batch);
+	kfree(reqs);
+
+	return ret;
+}
+
+static int gb_lights_channel_config(struct gb_light *light,
+			struct gb_channel *channel,
+			struct gb_lights_get_channel_config_response *conf)
+{
+	struct led_classdev *cdev = get_channel_cdev(channel);
+	char *name;
+	int ret;
 
 	channel->light = light;
-	channel->mode = le32_to_cpu(conf.mode);
-	channel->flags = le32_to_cpu(conf.flags);
-	channel->color = le32_to_cpu(conf.color);
-	channel->color_name = kstrndup(conf.color_name, NAMES_MAX, GFP_KERNEL);
+	channel->mode = le32_to_cpu(conf->mode);
+	channel->flags = le32_to_cpu(conf->flags);
+	channel->color = le32_to_cpu(conf->color);
+	channel->color_name = kstrndup(conf->color_name, NAMES_MAX, GFP_KERNEL);
 	if (!channel->color_name)
 		return -ENOMEM;
-	channel->mode_name = kstrndup(conf.mode_name, NAMES_MAX, GFP_KERNEL);
+	channel->mode_name = kstrndup(conf->mode_name, NAMES_MAX, GFP_KERNEL);
 	if (!channel->mode_name)
 		return -ENOMEM;
 
@@ -900,7 +930,7 @@ static int gb_lights_channel_config(struct gb_light *light,
 
 	cdev->name = name;
 
-	cdev->max_brightness = conf.max_brightness;
+	cdev->max_brightness = conf->max_brightness;
 
 	ret = channel_attr_groups_set(channel, cdev);
 	if (ret < 0)
@@ -930,6 +960,7 @@ static int gb_lights_light_config(struct gb_lights *glights, u8 id)
 	struct gb_light *light = &glights->lights[id];
 	struct gb_lights_get_light_config_request req;
 	struct gb_lights_get_light_config_response conf;
+	struct gb_lights_get_channel_config_response *confs;
 	int ret;
 	int i;
 
@@ -958,12 +989,19 @@ static int gb_lights_light_config(struct gb_lights *glights, u8 id)
 		return -ENOMEM;
 
 	/* First we collect all the configurations for all channels */
-	for (i = 0; i < light->channels_count; i++) {
+	confs = kcalloc(light->channels_count, sizeof(*confs), GFP_KERNEL);
+	if (!confs)
+		return -ENOMEM;
+
+	ret = gb_lights_channel_configs_get(light, confs);
+	for (i = 0; !ret && i < light->channels_count; i++) {
 		light->channels[i].id = i;
-		ret = gb_lights_channel_config(light, &light->channels[i]);
-		if (ret < 0)
-			return ret;
+		ret = gb_lights_channel_config(light, &light->channels[i],
+					       &confs[i]);
 	}
+	kfree(confs);
+	if (ret < 0)
+		return ret;
 
 	/*
 	 * Then, if everything went ok in getting configurations, we register
@@ -995,6 +995,8 @@ static struct gb_protocol loopback_protocol = {
 	.connection_init	= gb_loopback_connection_init,
 	.connection_exit	= gb_loopback_connection_exit,
 	.request_recv		= gb_loopback_request_recv,
+	.request_pool_size	= 8,
+	.flags			= GB_PROTOCOL_CONCURRENT_REQUESTS,
 };
 
 static int loopback_init(void)
@@ -8,7 +8,11 @@
  */
 
 #include <linux/kernel.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
+#include <linux/math64.h>
 #include <linux/slab.h>
+#include <linux/mempool.h>
 #include <linux/module.h>
 #include <linux/sched.h>
 #include <linux/wait.h>
@@ -20,29 +24,42 @@
 static struct kmem_cache *gb_operation_cache;
 static struct kmem_cache *gb_message_cache;
 
+/* Size classes of message buffers too big to be stored inline */
+static const size_t gb_message_buffer_sizes[] = { 256, 512, 1024, 2048 };
+static struct kmem_cache *
+gb_message_buffer_caches[ARRAY_SIZE(gb_message_buffer_sizes)];
+
 /* Workqueue to handle Greybus operation completions. */
 static struct workqueue_struct *gb_operation_completion_wq;
 
+/* Workqueue shared by all connections to handle incoming requests. */
+static struct workqueue_struct *gb_operation_request_wq;
+
 /* Wait queue for synchronous cancellations. */
 static DECLARE_WAIT_QUEUE_HEAD(gb_operation_cancellation_queue);
 
-/*
- * Protects updates to operation->errno.
- */
-static DEFINE_SPINLOCK(gb_operations_lock);
-
 static int gb_operation_response_send(struct gb_operation *operation,
 					int errno);
+static void gb_operation_nomem_refill(struct gb_connection *connection);
+static struct gb_message *
+gb_operation_message_alloc(struct gb_connection *connection, u8 type,
+				size_t payload_size, bool outbound,
+				gfp_t gfp_flags);
 
 /*
  * Increment operation active count and add to connection list unless the
  * connection is going away.
  *
+ * An outgoing operation being activated also takes a slot in the
+ * connection's window of requests in flight, and -EAGAIN is returned if
+ * the window is full.
+ *
  * Caller holds operation reference.
  */
 static int gb_operation_get_active(struct gb_operation *operation)
 {
 	struct gb_connection *connection = operation->connection;
+	bool outgoing = !gb_operation_is_incoming(operation);
 	unsigned long flags;
 
 	spin_lock_irqsave(&connection->lock, flags);
@@ -52,8 +69,20 @@ static int gb_operation_get_active(struct gb_operation *operation)
 		return -ENOTCONN;
 	}
 
-	if (operation->active++ == 0)
+	if (outgoing && !operation->active && connection->window &&
+			connection->in_flight >= connection->window) {
+		spin_unlock_irqrestore(&connection->lock, flags);
+		return -EAGAIN;
+	}
+
+	if (operation->active++ == 0) {
 		list_add_tail(&operation->links, &connection->operations);
+		if (outgoing) {
+			hash_add(connection->outgoing_operations,
+					&operation->hash_link, operation->id);
+			connection->in_flight++;
+		}
+	}
 
 	spin_unlock_irqrestore(&connection->lock, flags);
 
@@ -69,6 +98,11 @@ static void gb_operation_put_active(struct gb_operation *operation)
 	spin_lock_irqsave(&connection->lock, flags);
 	if (--operation->active == 0) {
 		list_del(&operation->links);
+		if (!gb_operation_is_incoming(operation)) {
+			hash_del(&operation->hash_link);
+			connection->in_flight--;
+			wake_up(&connection->window_wq);
+		}
 		if (atomic_read(&operation->waiters))
 			wake_up(&gb_operation_cancellation_queue);
 	}
@@ -112,10 +146,13 @@ static bool gb_operation_is_active(struct gb_operation *operation)
  * value to set for an operation in initial state is -EINPROGRESS.
  * Attempts to do otherwise will also record a (successful) -EILSEQ
  * operation result.
+ *
+ * The result is updated with cmpxchg() rather than under a lock, so
+ * that concurrent completions on different operations (and different
+ * connections) do not contend with one another.
  */
 static bool gb_operation_result_set(struct gb_operation *operation, int result)
 {
-	unsigned long flags;
 	int prev;
 
 	if (result == -EINPROGRESS) {
@@ -126,14 +163,9 @@ static bool gb_operation_result_set(struct gb_operation *operation, int result)
 		 * and record an implementation error if it's
 		 * set at any other time.
 		 */
-		spin_lock_irqsave(&gb_operations_lock, flags);
-		prev = operation->errno;
-		if (prev == -EBADR)
-			operation->errno = result;
-		else
-			operation->errno = -EILSEQ;
-		spin_unlock_irqrestore(&gb_operations_lock, flags);
-		WARN_ON(prev != -EBADR);
+		prev = cmpxchg(&operation->errno, -EBADR, result);
+		if (WARN_ON(prev != -EBADR))
+			xchg(&operation->errno, -EILSEQ);
 
 		return true;
 	}
@@ -150,11 +182,7 @@ static bool gb_operation_result_set(struct gb_operation *operation, int result)
 	if (WARN_ON(result == -EBADR))
 		result = -EILSEQ; /* Nobody should be setting -EBADR */
 
-	spin_lock_irqsave(&gb_operations_lock, flags);
-	prev = operation->errno;
-	if (prev == -EINPROGRESS)
-		operation->errno = result;	/* First and final result */
-	spin_unlock_irqrestore(&gb_operations_lock, flags);
+	prev = cmpxchg(&operation->errno, -EINPROGRESS, result);
 
 	return prev == -EINPROGRESS;
 }
@@ -173,6 +201,9 @@ EXPORT_SYMBOL_GPL(gb_operation_result);
 /*
  * Looks up an outgoing operation on a connection and returns a refcounted
  * pointer if found, or NULL otherwise.
+ *
+ * Active outgoing operations are hashed by id, so the lookup cost does not
+ * depend on the number of operations in flight on the connection.
  */
 static struct gb_operation *
 gb_operation_find_outgoing(struct gb_connection *connection, u16 operation_id)
@@ -182,9 +213,9 @@ gb_operation_find_outgoing(struct gb_connection *connection, u16 operation_id)
 	bool found = false;
 
 	spin_lock_irqsave(&connection->lock, flags);
-	list_for_each_entry(operation, &connection->operations, links)
-		if (operation->id == operation_id &&
-				!gb_operation_is_incoming(operation)) {
+	hash_for_each_possible(connection->outgoing_operations, operation,
+				hash_link, operation_id)
+		if (operation->id == operation_id) {
 			gb_operation_get(operation);
 			found = true;
 			break;
@@ -194,15 +225,101 @@ gb_operation_find_outgoing(struct gb_connection *connection, u16 operation_id)
 	return found ? operation : NULL;
 }
 
-static int gb_message_send(struct gb_message *message, gfp_t gfp)
+static bool gb_connection_window_open(struct gb_connection *connection)
+{
+	return connection->state != GB_CONNECTION_STATE_ENABLED ||
+		!connection->window ||
+		connection->in_flight < connection->window;
+}
+
+/*
+ * Activate an outgoing operation, waiting for the connection's window of
+ * requests in flight to open if it is full and the caller can sleep.
+ */
+static int gb_operation_get_active_window(struct gb_operation *operation,
+						gfp_t gfp)
+{
+	struct gb_connection *connection = operation->connection;
+	int ret;
+
+	while (1) {
+		ret = gb_operation_get_active(operation);
+		if (ret != -EAGAIN || !gfpflags_allow_blocking(gfp))
+			return ret;
+
+		ret = wait_event_interruptible(connection->window_wq,
+					gb_connection_window_open(connection));
+		if (ret)
+			return ret;
+	}
+}
+
+/* Pass a message (or fragment) to the host device to be sent. */
+static int gb_message_hd_send(struct gb_message *message, gfp_t gfp)
 {
 	struct gb_connection *connection = message->operation->connection;
+	int ret;
 
 	trace_gb_message_send(message);
-	return connection->hd->driver->message_send(connection->hd,
+	ret = connection->hd->driver->message_send(connection->hd,
 					connection->hd_cport_id,
 					message,
 					gfp);
+	if (ret)
+		gb_connection_stats_inc(connection, tx_errors);
+
+	return ret;
+}
+
+/*
+ * Send the next fragment of a message too big for the host device.  The
+ * fragment message is allocated when the first fragment is sent, and
+ * reused for the following ones, which are sent from
+ * greybus_message_sent() as soon as the previous one has gone out.
+ */
+static int gb_message_fragment_send(struct gb_message *message, gfp_t gfp)
+{
+	struct gb_connection *connection = message->operation->connection;
+	struct greybus_host_device *hd = connection->hd;
+	struct gb_message *fragment = message->fragment;
+	size_t header_size = sizeof(*message->header);
+	size_t offset = message->fragment_offset;
+	size_t len;
+
+	if (!fragment) {
+		fragment = gb_operation_message_alloc(connection,
+					message->header->type,
+					hd->buffer_size_max - header_size,
+					true, gfp);
+		if (!fragment)
+			return -ENOMEM;
+		fragment->operation = message->operation;
+		message->fragment = fragment;
+	}
+
+	len = min(message->payload_size - offset, fragment->payload_size);
+
+	memcpy(fragment->header, message->header, header_size);
+	fragment->header->size = cpu_to_le16(header_size + len);
+	if (offset + len < message->payload_size)
+		fragment->header->pad[1] = GB_OPERATION_MSG_FLAG_MORE;
+	memcpy(fragment->header + 1, message->payload + offset, len);
+
+	message->fragment_offset += len;
+
+	return gb_message_hd_send(fragment, gfp);
+}
+
+static int gb_message_send(struct gb_message *message, gfp_t gfp)
+{
+	struct gb_connection *connection = message->operation->connection;
+
+	if (gb_message_size(message) > connection->hd->buffer_size_max) {
+		message->fragment_offset = 0;
+		return gb_message_fragment_send(message, gfp);
+	}
+
+	return gb_message_hd_send(message, gfp);
 }
 
 /*
@@ -212,9 +329,46 @@ static void gb_message_cancel(struct gb_message *message)
 {
 	struct greybus_host_device *hd = message->operation->connection->hd;
 
+	if (message->fragment)
+		message = message->fragment;
+
 	hd->driver->message_cancel(message);
 }
 
+/*
+ * Append the payload of a received fragment to a message being
+ * reassembled.  Once the last fragment has arrived, the message header is
+ * filled in from it, with the size of the complete message.
+ *
+ * Returns -EINPROGRESS if more fragments are expected, 0 once the
+ * message is complete, or -EMSGSIZE if the message buffer is too small.
+ */
+static int gb_message_fragment_recv(struct gb_message *message,
+					void *data, size_t size)
+{
+	struct gb_operation_msg_hdr *header = data;
+	size_t len = size - sizeof(*header);
+
+	if (message->fragment_offset + len > message->payload_size) {
+		message->fragment_offset = 0;
+		return -EMSGSIZE;
+	}
+
+	memcpy(message->payload + message->fragment_offset, header + 1, len);
+	message->fragment_offset += len;
+
+	if (header->pad[1] & GB_OPERATION_MSG_FLAG_MORE)
+		return -EINPROGRESS;
+
+	memcpy(message->header, header, sizeof(*header));
+	message->header->size = cpu_to_le16(sizeof(*header) +
+						message->fragment_offset);
+	message->header->pad[1] = 0;
+	message->fragment_offset = 0;
+
+	return 0;
+}
+
 static void gb_operation_request_handle(struct gb_operation *operation)
 {
 	struct gb_protocol *protocol = operation->connection->protocol;
@@ -260,15 +414,155 @@ static void gb_operation_work(struct work_struct *work)
 
 	operation = container_of(work, struct gb_operation, work);
 
-	if (gb_operation_is_incoming(operation))
+	trace_gb_operation_callback(operation);
+
+	if (gb_operation_is_incoming(operation)) {
 		gb_operation_request_handle(operation);
-	else
+		gb_operation_nomem_refill(operation->connection);
+	} else {
+		/*
+		 * The request message may still be stuck in the host device
+		 * if no response came in time.  A timeout reported by the
+		 * remote end comes with a response, so is not enough.
+		 */
+		if (operation->flags & GB_OPERATION_FLAG_TIMED_OUT)
+			gb_message_cancel(operation->request);
 		operation->callback(operation);
+	}
 
 	gb_operation_put_active(operation);
 	gb_operation_put(operation);
 }
 
+/*
+ * Handle the incoming requests of a connection.  Requests are queued to
+ * their connection and handled one at a time, in order of arrival, by a
+ * per-connection work item running on the workqueue shared by all
+ * connections.
+ *
+ * Requests for protocols with GB_PROTOCOL_CONCURRENT_REQUESTS set are
+ * instead queued individually, so that they can be handled in parallel.
+ */
+void gb_operation_request_work(struct work_struct *work)
+{
+	struct gb_connection *connection;
+	struct gb_operation *operation;
+
+	connection = container_of(work, struct gb_connection, request_work);
+
+	spin_lock_irq(&connection->lock);
+	while (!list_empty(&connection->request_queue)) {
+		operation = list_first_entry(&connection->request_queue,
+						struct gb_operation, queue_link);
+		list_del(&operation->queue_link);
+		spin_unlock_irq(&connection->lock);
+
+		gb_operation_work(&operation->work);
+
+		spin_lock_irq(&connection->lock);
+	}
+	spin_unlock_irq(&connection->lock);
+}
+
+static void gb_operation_request_queue(struct gb_operation *operation)
+{
+	struct gb_connection *connection = operation->connection;
+	unsigned long flags;
+
+	if (connection->protocol->flags & GB_PROTOCOL_CONCURRENT_REQUESTS) {
+		queue_work(gb_operation_request_wq, &operation->work);
+		return;
+	}
+
+	spin_lock_irqsave(&connection->lock, flags);
+	list_add_tail(&operation->queue_link, &connection->request_queue);
+	spin_unlock_irqrestore(&connection->lock, flags);
+
+	queue_work(gb_operation_request_wq, &connection->request_work);
+}
+
+/*
+ * Record the latency of an operation whose response has just arrived, or
+ * which has just timed out.  Called in atomic context.
+ */
+static void gb_operation_latency_record(struct gb_operation *operation)
+{
+	struct gb_operation_latency *latency;
+	unsigned int type;
+	unsigned int bucket;
+	u32 us;
+
+	us = (u32)ktime_us_delta(ktime_get(), operation->start);
+	bucket = us ? ilog2(us) + 1 : 0;
+	bucket = min(bucket, GB_OPERATION_LATENCY_BUCKETS - 1U);
+	type = min_t(unsigned int, operation->type,
+			GB_OPERATION_LATENCY_TYPES - 1);
+
+	latency = get_cpu_ptr(operation->connection->latency);
+	latency->buckets[type][bucket]++;
+	if (us > latency->max[type])
+		latency->max[type] = us;
+	put_cpu_ptr(operation->connection->latency);
+}
+
+/*
+ * Response timeouts use the kernel timer wheel, which makes arming and
+ * disarming them O(1) however many operations are in flight.  A pending
+ * timer holds a reference to its operation.
+ */
+static void gb_operation_timeout(unsigned long data)
+{
+	struct gb_operation *operation = (struct gb_operation *)data;
+
+	/*
+	 * Always complete timed-out operations from the workqueue, where
+	 * the request message can be cancelled.
+	 */
+	if (gb_operation_result_set(operation, -ETIMEDOUT)) {
+		operation->flags |= GB_OPERATION_FLAG_TIMED_OUT;
+		gb_connection_stats_inc(operation->connection, timeouts);
+		/* So that adaptive timeouts grow back once they got too short */
+		gb_operation_latency_record(operation);
+		queue_work(gb_operation_completion_wq, &operation->work);
+	}
+
+	gb_operation_put(operation);
+}
+
+static void gb_operation_timer_arm(struct gb_operation *operation,
+					unsigned int timeout)
+{
+	gb_operation_get(operation);
+	mod_timer(&operation->timer, jiffies + msecs_to_jiffies(timeout));
+}
+
+static void gb_operation_timer_cancel(struct gb_operation *operation)
+{
+	if (del_timer(&operation->timer))
+		gb_operation_put(operation);
+}
+
+/*
+ * Complete an outgoing operation whose final result has just been set.
+ *
+ * Operations whose callback is safe to call in atomic context are
+ * completed directly; all others have their callback run from the
+ * completion workqueue.
+ */
+static void gb_operation_complete(struct gb_operation *operation)
+{
+	gb_operation_timer_cancel(operation);
+
+	if (gb_operation_has_atomic_callback(operation)) {
+		trace_gb_operation_callback(operation);
+		operation->callback(operation);
+		gb_operation_put_active(operation);
+		gb_operation_put(operation);
+	} else {
+		queue_work(gb_operation_completion_wq, &operation->work);
+	}
+}
+
 static void gb_operation_message_init(struct greybus_host_device *hd,
 				struct gb_message *message, u16 operation_id,
 				size_t payload_size, u8 type)
@@ -305,6 +599,139 @@ static void gb_operation_message_init(struct greybus_host_device *hd,
 	}
 }
 
+/*
+ * Set up a zeroed buffer of at least @size bytes for a message: its inline
+ * buffer if that is big enough, or one from the smallest fitting size
+ * class.  The message is left untouched on failure.
+ */
+static int gb_message_buffer_alloc(struct gb_message *message, size_t size,
+					gfp_t gfp)
+{
+	struct kmem_cache *cache = NULL;
+	void *buffer;
+	int i;
+
+	if (size <= GB_MESSAGE_INLINE_SIZE) {
+		memset(message->inline_buffer, 0, size);
+		message->buffer = message->inline_buffer;
+		message->buffer_cache = NULL;
+		return 0;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(gb_message_buffer_sizes); i++) {
+		if (size <= gb_message_buffer_sizes[i]) {
+			cache = gb_message_buffer_caches[i];
+			break;
+		}
+	}
+
+	if (cache)
+		buffer = kmem_cache_alloc(cache, gfp);
+	else
+		buffer = kmalloc(size, gfp);
+	if (!buffer)
+		return -ENOMEM;
+
+	memset(buffer, 0, size);
+	message->buffer = buffer;
+	message->buffer_cache = cache;
+
+	return 0;
+}
+
+static void __gb_message_buffer_free(struct gb_message *message,
+					void *buffer, struct kmem_cache *cache)
+{
+	if (buffer == message->inline_buffer)
+		return;
+
+	if (cache)
+		kmem_cache_free(cache, buffer);
+	else
+		kfree(buffer);
+}
+
+/*
+ * Set up a zeroed buffer provided by the host device for an outbound
+ * message.  The message is left untouched on failure.
+ */
+static int gb_message_hd_buffer_alloc(struct greybus_host_device *hd,
+					struct gb_message *message,
+					size_t size, gfp_t gfp)
+{
+	void *buffer;
+
+	if (!hd->driver->message_buffer_alloc)
+		return -EOPNOTSUPP;
+
+	buffer = hd->driver->message_buffer_alloc(hd, size, gfp);
+	if (!buffer)
+		return -ENOMEM;
+
+	/* The buffer may outlive the removal of the host device */
+	gb_hd_get(hd);
+
+	memset(buffer, 0, size);
+	message->buffer = buffer;
+	message->buffer_hd = hd;
+
+	return 0;
+}
+
+static void gb_message_buffer_free(struct gb_message *message)
+{
+	struct greybus_host_device *hd = message->buffer_hd;
+
+	if (hd) {
+		hd->driver->message_buffer_free(hd, message->buffer);
+		gb_hd_put(hd);
+		return;
+	}
+
+	__gb_message_buffer_free(message, message->buffer,
+					message->buffer_cache);
+}
+
+/* Usable size of a message buffer */
+static size_t gb_message_buffer_size(struct gb_message *message)
+{
+	if (message->buffer == message->inline_buffer)
+		return GB_MESSAGE_INLINE_SIZE;
+
+	if (message->buffer_cache)
+		return kmem_cache_size(message->buffer_cache);
+
+	return ksize(message->buffer);
+}
+
+/*
+ * Grow a message buffer to at least @size bytes, preserving the header and
+ * payload it holds.  Only used for inbound messages, which never have a
+ * host device buffer.
+ */
+static int gb_message_buffer_resize(struct gb_message *message, size_t size,
+					gfp_t gfp)
+{
+	struct kmem_cache *cache = message->buffer_cache;
+	void *buffer = message->buffer;
+	size_t used;
+	int ret;
+
+	if (size <= gb_message_buffer_size(message))
+		return 0;
+
+	used = sizeof(*message->header) + message->payload_size;
+
+	ret = gb_message_buffer_alloc(message, size, gfp);
+	if (ret)
+		return ret;
+
+	memcpy(message->buffer, buffer, used);
+	__gb_message_buffer_free(message, buffer, cache);
+
+	return 0;
+}
+
 /*
  * Allocate a message to be used for an operation request or response.
  * Both types of message contain a common header.  The request message
@@ -313,23 +740,26 @@ static void gb_operation_message_init(struct greybus_host_device *hd,
  * message is partially initialized here.
  *
  * The headers for inbound messages don't need to be initialized;
- * they'll be filled in by arriving data.
+ * they'll be filled in by arriving data.  Outbound messages get a buffer
+ * from the host device if it provides them.
  *
  * Our message buffers have the following layout:
  *	message header  \_ these combined are
  *	message payload /  the message size
  */
 static struct gb_message *
-gb_operation_message_alloc(struct greybus_host_device *hd, u8 type,
-				size_t payload_size, gfp_t gfp_flags)
+gb_operation_message_alloc(struct gb_connection *connection, u8 type,
+				size_t payload_size, bool outbound,
+				gfp_t gfp_flags)
 {
+	struct greybus_host_device *hd = connection->hd;
 	struct gb_message *message;
 	struct gb_operation_msg_hdr *header;
 	size_t message_size = payload_size + sizeof(*header);
 
-	if (message_size > hd->buffer_size_max) {
+	if (message_size > connection->message_size_max) {
 		pr_warn("requested message size too big (%zu > %zu)\n",
-				message_size, hd->buffer_size_max);
+				message_size, connection->message_size_max);
 		return NULL;
 	}
 
@@ -338,9 +768,11 @@ gb_operation_message_alloc(struct greybus_host_device *hd, u8 type,
 	if (!message)
 		return NULL;
 
-	message->buffer = kzalloc(message_size, gfp_flags);
-	if (!message->buffer)
-		goto err_free_message;
+	if (!outbound ||
+	    gb_message_hd_buffer_alloc(hd, message, message_size, gfp_flags)) {
+		if (gb_message_buffer_alloc(message, message_size, gfp_flags))
+			goto err_free_message;
+	}
 
 	/* Initialize the message.  Operation id is filled in later. */
 	gb_operation_message_init(hd, message, 0, payload_size, type);
@@ -353,9 +785,51 @@ err_free_message:
 	return NULL;
 }
 
+/*
+ * Use a receive buffer loaned by the host device as the message buffer,
+ * instead of copying its content into the message's own buffer.
+ */
+static void gb_message_adopt(struct gb_message *message, void *data)
+{
+	message->header = data;
+	if (message->payload_size)
+		message->payload = message->header + 1;
+}
+
+static bool gb_message_is_loaned(struct gb_message *message)
+{
+	return (void *)message->header != message->buffer;
+}
+
+/*
+ * Hand a loaned receive buffer back to the host device, and switch the
+ * message back to its own buffer.
+ */
+static void gb_message_loan_return(struct gb_message *message)
+{
+	struct greybus_host_device *hd;
+
+	if (!gb_message_is_loaned(message))
+		return;
+
+	hd = message->operation->connection->hd;
+	hd->driver->buffer_free(hd, message->header);
+
+	message->header = message->buffer;
+	if (message->payload_size)
+		message->payload = message->header + 1;
+}
+
 static void gb_operation_message_free(struct gb_message *message)
 {
-	kfree(message->buffer);
+	if (message->fragment)
+		gb_operation_message_free(message->fragment);
+
+	if (message->operation)
+		gb_message_loan_return(message);
+
+	kfree(message->sg);
+	gb_message_buffer_free(message);
 	kmem_cache_free(gb_message_cache, message);
 }
 
@@ -430,13 +904,15 @@ static u8 gb_operation_errno_map(int errno)
 bool gb_operation_response_alloc(struct gb_operation *operation,
 					size_t response_size, gfp_t gfp)
 {
-	struct greybus_host_device *hd = operation->connection->hd;
+	struct gb_connection *connection = operation->connection;
 	struct gb_operation_msg_hdr *request_header;
 	struct gb_message *response;
 	u8 type;
 
 	type = operation->type | GB_MESSAGE_TYPE_RESPONSE;
-	response = gb_operation_message_alloc(hd, type, response_size, gfp);
+	response = gb_operation_message_alloc(connection, type, response_size,
+					gb_operation_is_incoming(operation),
+					gfp);
 	if (!response)
 		return false;
 	response->operation = operation;
@@ -455,6 +931,26 @@ bool gb_operation_response_alloc(struct gb_operation *operation,
 }
 EXPORT_SYMBOL_GPL(gb_operation_response_alloc);
 
+/*
+ * (Re)initialize the state of an operation.  Operations taken from a
+ * connection's request pool may have been used before.
+ */
+static void gb_operation_init_common(struct gb_operation *operation, u8 type,
+					unsigned long op_flags)
+{
+	operation->flags = op_flags;
+	operation->type = type;
+	operation->errno = -EBADR;  /* Initial value--means "never set" */
+
+	INIT_WORK(&operation->work, gb_operation_work);
+	init_completion(&operation->completion);
+	setup_timer(&operation->timer, gb_operation_timeout,
+			(unsigned long)operation);
+	kref_init(&operation->kref);
+	atomic_set(&operation->waiters, 0);
+	operation->created = ktime_get();
+}
+
 /*
  * Create a Greybus operation to be sent over the given connection.
  * The request buffer will be big enough for a payload of the given
@@ -482,7 +978,6 @@ gb_operation_create_common(struct gb_connection *connection, u8 type,
 				size_t request_size, size_t response_size,
 				unsigned long op_flags, gfp_t gfp_flags)
 {
-	struct greybus_host_device *hd = connection->hd;
 	struct gb_operation *operation;
 
 	operation = kmem_cache_zalloc(gb_operation_cache, gfp_flags);
@@ -490,8 +985,12 @@ gb_operation_create_common(struct gb_connection *connection, u8 type,
 		return NULL;
 	operation->connection = connection;
 
-	operation->request = gb_operation_message_alloc(hd, type, request_size,
-							gfp_flags);
+	/* Requests described by a scatter-gather list need a linear buffer */
+	operation->request = gb_operation_message_alloc(connection, type,
+					request_size,
+					!(op_flags & (GB_OPERATION_FLAG_INCOMING |
+						      GB_OPERATION_FLAG_SG)),
+					gfp_flags);
 	if (!operation->request)
 		goto err_cache;
 	operation->request->operation = operation;
@@ -504,14 +1003,7 @@ gb_operation_create_common(struct gb_connection *connection, u8 type,
 		}
 	}
 
-	operation->flags = op_flags;
-	operation->type = type;
-	operation->errno = -EBADR;  /* Initial value--means "never set" */
-
-	INIT_WORK(&operation->work, gb_operation_work);
-	init_completion(&operation->completion);
-	kref_init(&operation->kref);
-	atomic_set(&operation->waiters, 0);
+	gb_operation_init_common(operation, type, op_flags);
 
 	return operation;
 
@@ -530,33 +1022,295 @@ err_cache:
  * these are allowed to be 0.  Note that 0x00 is reserved as an
  * invalid operation type for all protocols, and this is enforced
  * here.
+ *
+ * The only flag a caller may pass is GB_OPERATION_FLAG_ATOMIC_CALLBACK,
+ * which declares that the operation callback may be called in atomic
+ * context, directly from the receive path.
  */
-struct gb_operation *gb_operation_create(struct gb_connection *connection,
-					u8 type, size_t request_size,
-					size_t response_size,
-					gfp_t gfp)
+struct gb_operation *
+gb_operation_create_flags(struct gb_connection *connection,
+				u8 type, size_t request_size,
+				size_t response_size, unsigned long flags,
+				gfp_t gfp)
 {
+	struct gb_operation *operation;
+
 	if (WARN_ON_ONCE(type == GB_OPERATION_TYPE_INVALID))
 		return NULL;
 	if (WARN_ON_ONCE(type & GB_MESSAGE_TYPE_RESPONSE))
 		type &= ~GB_MESSAGE_TYPE_RESPONSE;
+	if (WARN_ON_ONCE(flags & ~GB_OPERATION_FLAG_USER_MASK))
+		flags &= GB_OPERATION_FLAG_USER_MASK;
 
-	return gb_operation_create_common(connection, type,
-					request_size, response_size, 0, gfp);
-}
-EXPORT_SYMBOL_GPL(gb_operation_create);
-
-size_t gb_operation_get_payload_size_max(struct gb_connection *connection)
+	operation = gb_operation_create_common(connection, type,
+					request_size, response_size,
+					flags, gfp);
+	if (operation)
+		trace_gb_operation_create(operation);
+
+	return operation;
+}
+EXPORT_SYMBOL_GPL(gb_operation_create_flags);
+
+/*
+ * Describe an outbound message with a scatter-gather list.  The first
+ * entry covers the message header and (linear) payload; the others the
+ * @size bytes of data of @sg starting at offset @skip, which will be
+ * sent right after the payload.
+ */
+static int gb_message_sg_init(struct gb_message *message,
+				struct scatterlist *sg, unsigned int nents,
+				off_t skip, size_t size, gfp_t gfp)
+{
+	struct scatterlist *src;
+	struct scatterlist *dst;
+	unsigned int num_sgs = 1;
+	size_t len;
+	int i;
+
+	message->sg = kmalloc_array(nents + 1, sizeof(*message->sg), gfp);
+	if (!message->sg)
+		return -ENOMEM;
+
+	sg_init_table(message->sg, nents + 1);
+	sg_set_buf(message->sg, message->header,
+			sizeof(*message->header) + message->payload_size);
+
+	dst = message->sg;
+	for_each_sg(sg, src, nents, i) {
+		if (!size)
+			break;
+
+		if (skip >= src->length) {
+			skip -= src->length;
+			continue;
+		}
+
+		len = min_t(size_t, src->length - skip, size);
+		dst = sg_next(dst);
+		sg_set_page(dst, sg_page(src), len, src->offset + skip);
+		skip = 0;
+		size -= len;
+		num_sgs++;
+	}
+
+	if (size) {
+		kfree(message->sg);
+		message->sg = NULL;
+		return -EINVAL;
+	}
+
+	sg_mark_end(dst);
+	message->num_sgs = num_sgs;
+
+	return 0;
+}
+
+/*
+ * Create an operation whose request carries, after a payload of
+ * @request_size bytes, @sg_size bytes of data described by the
+ * scatter-gather list @sg (starting at offset @skip).  The caller fills
+ * in the first @request_size bytes of the request payload as usual.
+ *
+ * If the host device can send scatter-gather messages the data is not
+ * copied; otherwise, or if the request has to be fragmented, it is
+ * copied into the request payload.
+ */
+struct gb_operation *
+gb_operation_create_sg(struct gb_connection *connection, u8 type,
+				size_t request_size, size_t response_size,
+				struct scatterlist *sg, unsigned int nents,
+				off_t skip, size_t sg_size, gfp_t gfp)
 {
 	struct greybus_host_device *hd = connection->hd;
+	struct gb_operation *operation;
+	struct gb_message *request;
+	size_t message_size;
+	size_t copied;
+
+	message_size = sizeof(struct gb_operation_msg_hdr) + request_size +
+			sg_size;
+	if (message_size > connection->message_size_max) {
+		pr_warn("requested message size too big (%zu > %zu)\n",
+				message_size, connection->message_size_max);
+		return NULL;
+	}
+
+	if (nents + 1 > hd->sg_tablesize ||
+	    message_size > hd->buffer_size_max) {
+		operation = gb_operation_create(connection, type,
+						request_size + sg_size,
+						response_size, gfp);
+		if (!operation)
+			return NULL;
+
+		copied = sg_pcopy_to_buffer(sg, nents,
+				operation->request->payload + request_size,
+				sg_size, skip);
+		if (copied != sg_size)
+			goto err_put;
+
+		return operation;
+	}
+
+	if (WARN_ON_ONCE(type == GB_OPERATION_TYPE_INVALID))
+		return NULL;
+
+	operation = gb_operation_create_common(connection, type, request_size,
+					response_size, GB_OPERATION_FLAG_SG,
+					gfp);
+	if (!operation)
+		return NULL;
+
+	request = operation->request;
+	if (gb_message_sg_init(request, sg, nents, skip, sg_size, gfp))
+		goto err_put;
+
+	request->header->size = cpu_to_le16(message_size);
+	trace_gb_operation_create(operation);
+
+	return operation;
 
-	return hd->buffer_size_max - sizeof(struct gb_operation_msg_hdr);
+err_put:
+	gb_operation_put(operation);
+
+	return NULL;
+}
+EXPORT_SYMBOL_GPL(gb_operation_create_sg);
+
+/*
+ * Returns the largest payload an operation message can carry on the
+ * connection, which exceeds what the host device can transfer at once if
+ * message fragmentation has been negotiated.
+ */
+size_t gb_operation_get_payload_size_max(struct gb_connection *connection)
+{
+	return connection->message_size_max -
+			sizeof(struct gb_operation_msg_hdr);
 }
 EXPORT_SYMBOL_GPL(gb_operation_get_payload_size_max);
 
+/*
+ * Incoming operations fall back to a per-connection mempool when an
+ * exactly sized atomic allocation fails, so that a minimum number of
+ * requests can always be accepted.  Every pool element carries a request buffer
+ * big enough for the largest message the host device can receive
+ * (fragmented requests are reassembled outside the pool).
+ */
+static void *gb_operation_pool_alloc(gfp_t gfp_mask, void *pool_data)
+{
+	struct gb_connection *connection = pool_data;
+	size_t payload_size = connection->hd->buffer_size_max -
+				sizeof(struct gb_operation_msg_hdr);
+
+	return gb_operation_create_common(connection,
+					GB_OPERATION_TYPE_INVALID,
+					payload_size, 0,
+					GB_OPERATION_FLAG_INCOMING |
+					GB_OPERATION_FLAG_POOLED,
+					gfp_mask);
+}
+
+static void gb_operation_pool_free(void *element, void *pool_data)
+{
+	struct gb_operation *operation = element;
+
+	gb_operation_message_free(operation->request);
+	kmem_cache_free(gb_operation_cache, operation);
+}
+
+/*
+ * Allocate the operation used to report an out-of-memory condition to
+ * the sender of a request we could not allocate an operation for.  Its
+ * (empty) response message is allocated up front.
+ */
+static struct gb_operation *
+gb_operation_nomem_create(struct gb_connection *connection, gfp_t gfp)
+{
+	struct gb_operation *operation;
+
+	operation = gb_operation_create_common(connection,
+					GB_OPERATION_TYPE_INVALID, 0, 0,
+					GB_OPERATION_FLAG_INCOMING, gfp);
+	if (!operation)
+		return NULL;
+
+	if (!gb_operation_response_alloc(operation, 0, gfp)) {
+		gb_operation_put(operation);
+		return NULL;
+	}
+
+	return operation;
+}
+
+/*
+ * Replace the connection's reserved out-of-memory operation if it has
+ * been used.  Called in process context.
+ */
+static void gb_operation_nomem_refill(struct gb_connection *connection)
+{
+	struct gb_operation *operation;
+
+	if (connection->nomem_operation)
+		return;
+
+	operation = gb_operation_nomem_create(connection, GFP_KERNEL);
+	if (!operation)
+		return;
+
+	if (cmpxchg(&connection->nomem_operation, NULL, operation))
+		gb_operation_put(operation);
+}
+
+/*
+ * Set up the incoming-operation pool of a connection, sized according
+ * to the number of concurrent requests its protocol expects.
+ */
+int gb_operation_request_pool_create(struct gb_connection *connection)
+{
+	struct gb_protocol *protocol = connection->protocol;
+	int min_nr = GB_OPERATION_REQUEST_POOL_DEFAULT;
+
+	if (connection->request_pool)
+		return 0;
+
+	if (protocol && protocol->request_pool_size)
+		min_nr = protocol->request_pool_size;
+
+	connection->request_pool = mempool_create(min_nr,
+						gb_operation_pool_alloc,
+						gb_operation_pool_free,
+						connection);
+	if (!connection->request_pool)
+		return -ENOMEM;
+
+	connection->nomem_operation = gb_operation_nomem_create(connection,
+								GFP_KERNEL);
+	if (!connection->nomem_operation) {
+		mempool_destroy(connection->request_pool);
+		connection->request_pool = NULL;
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+void gb_operation_request_pool_destroy(struct gb_connection *connection)
+{
+	if (connection->nomem_operation) {
+		gb_operation_put(connection->nomem_operation);
+		connection->nomem_operation = NULL;
+	}
+
+	if (connection->request_pool) {
+		mempool_destroy(connection->request_pool);
+		connection->request_pool = NULL;
+	}
+}
+
 static struct gb_operation *
 gb_operation_create_incoming(struct gb_connection *connection, u16 id,
-				u8 type, void *data, size_t size)
+				u8 type, void *data, size_t size, bool loan)
 {
 	struct gb_operation *operation;
 	size_t request_size;
@@ -568,13 +1322,38 @@ gb_operation_create_incoming(struct gb_connection *connection, u16 id,
 	if (!id)
 		flags |= GB_OPERATION_FLAG_UNIDIRECTIONAL;
 
+	/*
+	 * Allocate an operation sized for this request, or with no payload
+	 * buffer at all when the receive buffer is adopted; the pool is only
+	 * drawn from when that fails, so its full-size reserved elements
+	 * are kept for memory pressure.
+	 */
 	operation = gb_operation_create_common(connection, type,
-					request_size, 0, flags, GFP_ATOMIC);
-	if (!operation)
-		return NULL;
+						loan ? 0 : request_size,
+						0, flags, GFP_ATOMIC);
+	if (operation && loan) {
+		gb_operation_message_init(connection->hd, operation->request,
+					id, request_size,
+					GB_OPERATION_TYPE_INVALID);
+	} else if (!operation) {
+		operation = mempool_alloc(connection->request_pool, GFP_ATOMIC);
+		if (!operation)
+			return NULL;
+
+		gb_operation_message_init(connection->hd, operation->request,
+					id, request_size,
+					GB_OPERATION_TYPE_INVALID);
+		gb_operation_init_common(operation, type,
+					flags | GB_OPERATION_FLAG_POOLED);
+	}
 
 	operation->id = id;
-	memcpy(operation->request->header, data, size);
+	if (loan)
+		gb_message_adopt(operation->request, data);
+	else
+		memcpy(operation->request->header, data, size);
+
+	trace_gb_operation_create(operation);
 
 	return operation;
 }
@@ -597,8 +1376,18 @@ static void _gb_operation_destroy(struct kref *kref)
 
 	operation = container_of(kref, struct gb_operation, kref);
 
+	trace_gb_operation_destroy(operation);
+
 	if (operation->response)
 		gb_operation_message_free(operation->response);
+
+	if (operation->flags & GB_OPERATION_FLAG_POOLED) {
+		gb_message_loan_return(operation->request);
+		operation->response = NULL;
+		mempool_free(operation, operation->connection->request_pool);
+		return;
+	}
+
 	gb_operation_message_free(operation->request);
 
 	kmem_cache_free(gb_operation_cache, operation);
@@ -617,12 +1406,98 @@ void gb_operation_put(struct gb_operation *operation)
 }
 EXPORT_SYMBOL_GPL(gb_operation_put);
 
-/* Tell the requester we're done */
+/* Tell the requester we're done.  May be called in atomic context. */
 static void gb_operation_sync_callback(struct gb_operation *operation)
 {
 	complete(&operation->completion);
 }
 
+/*
+ * Estimate, in microseconds, the latency under which @percent of the
+ * samples fall, interpolating linearly within the log2 bucket holding it.
+ */
+unsigned int gb_operation_latency_percentile(u32 *buckets, u64 count,
+					     unsigned int percent)
+{
+	u64 rank = div_u64(count * percent + 99, 100);
+	unsigned int lower;
+	unsigned int upper;
+	u64 sum = 0;
+	int i;
+
+	for (i = 0; i < GB_OPERATION_LATENCY_BUCKETS - 1; i++) {
+		if (sum + buckets[i] >= rank)
+			break;
+		sum += buckets[i];
+	}
+
+	/* Bucket i holds latencies from 2^(i-1) up to 2^i microseconds */
+	upper = 1U << i;
+	if (!i || !buckets[i])
+		return upper;
+	lower = upper >> 1;
+
+	return lower + div_u64((u64)(upper - lower) * (rank - sum), buckets[i]);
+}
+
+/*
+ * Derive a response timeout, in milliseconds, from the latency histogram
+ * of the operation's type.  The unbounded result is cached per CPU, for
+ * GB_OPERATION_TIMEOUT_REFRESH, as summing the histograms of every CPU is
+ * not cheap.
+ */
+static unsigned int gb_operation_timeout_adaptive(struct gb_operation *operation)
+{
+	struct gb_connection *connection = operation->connection;
+	struct gb_operation_latency *latency;
+	u32 buckets[GB_OPERATION_LATENCY_BUCKETS] = { 0 };
+	unsigned int timeout = GB_OPERATION_TIMEOUT_DEFAULT;
+	unsigned int type;
+	unsigned int p99;
+	u64 count = 0;
+	bool cached;
+	int cpu;
+	int i;
+
+	type = min_t(unsigned int, operation->type,
+			GB_OPERATION_LATENCY_TYPES - 1);
+
+	latency = get_cpu_ptr(connection->latency);
+	cached = latency->timeout[type] &&
+		 time_before(jiffies, latency->timeout_jiffies[type] +
+			     msecs_to_jiffies(GB_OPERATION_TIMEOUT_REFRESH));
+	if (cached)
+		timeout = latency->timeout[type];
+	put_cpu_ptr(connection->latency);
+	if (cached)
+		goto bound;
+
+	for_each_possible_cpu(cpu) {
+		latency = per_cpu_ptr(connection->latency, cpu);
+		for (i = 0; i < GB_OPERATION_LATENCY_BUCKETS; i++) {
+			buckets[i] += latency->buckets[type][i];
+			count += latency->buckets[type][i];
+		}
+	}
+
+	if (count >= GB_OPERATION_TIMEOUT_SAMPLES) {
+		p99 = gb_operation_latency_percentile(buckets, count, 99);
+		timeout = DIV_ROUND_UP(p99 * GB_OPERATION_TIMEOUT_P99,
+				       USEC_PER_MSEC);
+	}
+
+	latency = get_cpu_ptr(connection->latency);
+	latency->timeout[type] = timeout;
+	latency->timeout_jiffies[type] = jiffies;
+	put_cpu_ptr(connection->latency);
+
+bound:
+	timeout = max(timeout, ACCESS_ONCE(connection->timeout_min));
+	timeout = min(timeout, ACCESS_ONCE(connection->timeout_max));
+
+	return timeout;
+}
+
 /*
  * Send an operation request message. The caller has filled in any payload so
  * the request message is ready to go. The callback function supplied will be
@@ -630,9 +1505,19 @@ static void gb_operation_sync_callback(struct gb_operation *operation)
  * complete. In that case, the callback function is responsible for fetching
  * the result of the operation using gb_operation_result() if desired, and
  * dropping the initial reference to the operation.
+ *
+ * If no response has arrived within @timeout milliseconds (0 meaning no
+ * timeout), the operation is completed with -ETIMEDOUT.  The timeout is
+ * derived from the latency observed so far if @timeout is
+ * GB_OPERATION_TIMEOUT_ADAPTIVE.
+ *
+ * If the connection already has as many requests in flight as its window
+ * allows, this blocks until one completes when @gfp allows it, and fails
+ * with -EAGAIN otherwise.  The operation may then be sent again later.
  */
 int gb_operation_request_send(struct gb_operation *operation,
 				gb_operation_callback callback,
+				unsigned int timeout,
 				gfp_t gfp)
 {
 	struct gb_connection *connection = operation->connection;
@@ -643,9 +1528,10 @@ int gb_operation_request_send(struct gb_operation *operation,
 	if (!callback)
 		return -EINVAL;
 	/*
-	 * Record the callback function, which is executed in
-	 * non-atomic (workqueue) context when the final result
-	 * of an operation has been set.
+	 * Record the callback function, which is executed when the
+	 * final result of an operation has been set.  Unless the
+	 * operation has GB_OPERATION_FLAG_ATOMIC_CALLBACK set, it is
+	 * called in non-atomic (workqueue) context.
 	 */
 	operation->callback = callback;
 
@@ -665,19 +1551,30 @@ int gb_operation_request_send(struct gb_operation *operation,
 	 * operation completes.
 	 */
 	gb_operation_get(operation);
-	ret = gb_operation_get_active(operation);
+	ret = gb_operation_get_active_window(operation, gfp);
 	if (ret)
 		goto err_put;
 
+	if (timeout == GB_OPERATION_TIMEOUT_ADAPTIVE)
+		timeout = gb_operation_timeout_adaptive(operation);
+	if (timeout)
+		gb_operation_timer_arm(operation, timeout);
+
+	operation->start = ktime_get();
+	trace_gb_operation_send(operation);
 	ret = gb_message_send(operation->request, gfp);
 	if (ret)
-		goto err_put_active;
+		goto err_timer_cancel;
 
 	return 0;
 
-err_put_active:
+err_timer_cancel:
+	gb_operation_timer_cancel(operation);
 	gb_operation_put_active(operation);
 err_put:
+	/* Nothing has been sent, allow the request to be resubmitted */
+	if (ret == -EAGAIN)
+		operation->errno = -EBADR;
 	gb_operation_put(operation);
 
 	return ret;
@@ -694,26 +1591,19 @@ int gb_operation_request_send_sync_timeout(struct gb_operation *operation,
 						unsigned int timeout)
 {
 	int ret;
-	unsigned long timeout_jiffies;
+
+	/* Completing the waiter is safe to do from the receive path. */
+	operation->flags |= GB_OPERATION_FLAG_ATOMIC_CALLBACK;
 
 	ret = gb_operation_request_send(operation, gb_operation_sync_callback,
-					GFP_KERNEL);
+					timeout, GFP_KERNEL);
 	if (ret)
 		return ret;
 
-	if (timeout)
-		timeout_jiffies = msecs_to_jiffies(timeout);
-	else
-		timeout_jiffies = MAX_SCHEDULE_TIMEOUT;
-
-	ret = wait_for_completion_interruptible_timeout(&operation->completion,
-							timeout_jiffies);
+	ret = wait_for_completion_interruptible(&operation->completion);
 	if (ret < 0) {
 		/* Cancel the operation if interrupted */
 		gb_operation_cancel(operation, -ECANCELED);
-	} else if (ret == 0) {
-		/* Cancel the operation if op timed out */
-		gb_operation_cancel(operation, -ETIMEDOUT);
 	}
 
 	return gb_operation_result(operation);
@@ -760,6 +1650,7 @@ static int gb_operation_response_send(struct gb_operation *operation,
 	/* Fill in the response header and send it */
 	operation->response->header->result = gb_operation_errno_map(errno);
 
+	trace_gb_operation_send(operation);
 	ret = gb_message_send(operation->response, GFP_KERNEL);
 	if (ret)
 		goto err_put_active;
@@ -783,6 +1674,40 @@ void greybus_message_sent(struct greybus_host_device *hd,
 	struct gb_operation *operation = message->operation;
 	struct gb_connection *connection = operation->connection;
 
+	if (status) {
+		gb_connection_stats_inc(connection, tx_errors);
+	} else {
+		gb_connection_stats_inc(connection, tx_messages);
+		gb_connection_stats_add(connection, tx_bytes,
+					gb_message_size(message));
+	}
+
+	/*
+	 * A fragment of a request or response has been sent.  Unless an
+	 * error occurred, send the next one if the message has not been
+	 * cancelled (and the connection is not going away), and handle the
+	 * message itself once its last fragment is out.
+	 */
+	if (message == operation->request->fragment)
+		message = operation->request;
+	else if (operation->response && message == operation->response->fragment)
+		message = operation->response;
+
+	if (message->fragment && !status &&
+			message->fragment_offset < message->payload_size) {
+		if (connection->state != GB_CONNECTION_STATE_ENABLED)
+			status = -ESHUTDOWN;
+		else if (message == operation->request &&
+				operation->errno != -EINPROGRESS)
+			return;
+		else
+			status = gb_message_fragment_send(message, GFP_ATOMIC);
+		if (!status)
+			return;
+	}
+
+	trace_gb_operation_sent(operation);
+
 	/*
 	 * If the message was a response, we just need to drop our
 	 * reference to the operation.  If an error occurred, report
@@ -802,48 +1727,276 @@ void greybus_message_sent(struct greybus_host_device *hd,
 		gb_operation_put_active(operation);
 		gb_operation_put(operation);
 	} else if (status) {
-		if (gb_operation_result_set(operation, status)) {
-			queue_work(gb_operation_completion_wq,
-					&operation->work);
-		}
+		if (gb_operation_result_set(operation, status))
+			gb_operation_complete(operation);
 	}
 }
 EXPORT_SYMBOL_GPL(greybus_message_sent);
 
+/*
+ * Respond with GB_OP_NO_MEMORY to a request for which no operation could
+ * be allocated, so that the sender does not have to wait for its request
+ * to time out.  This uses the connection's reserved operation, which is
+ * replaced in process context once it has been consumed.
+ */
+static void gb_connection_recv_request_nomem(struct gb_connection *connection,
+						u16 operation_id, u8 type)
+{
+	struct gb_operation *operation;
+	struct gb_operation_msg_hdr *header;
+	int ret;
+
+	/* Sender of a unidirectional request does not expect a response. */
+	if (!operation_id)
+		return;
+
+	operation = xchg(&connection->nomem_operation, NULL);
+	if (!operation)
+		return;
+
+	operation->id = operation_id;
+	operation->type = type;
+
+	header = operation->response->header;
+	header->operation_id = cpu_to_le16(operation_id);
+	header->type = type | GB_MESSAGE_TYPE_RESPONSE;
+	header->result = gb_operation_errno_map(-ENOMEM);
+
+	gb_operation_result_set(operation, -EINPROGRESS);
+	gb_operation_result_set(operation, -ENOMEM);
+
+	/* Our reference will be dropped when the message has been sent. */
+	ret = gb_operation_get_active(operation);
+	if (ret)
+		goto err_put;
+
+	ret = gb_message_send(operation->response, GFP_ATOMIC);
+	if (ret)
+		goto err_put_active;
+
+	return;
+
+err_put_active:
+	gb_operation_put_active(operation);
+err_put:
+	gb_operation_put(operation);
+}
+
+/*
+ * Activate a received request and hand it to the connection workqueue.
+ * The initial reference to the operation will be dropped when the
+ * request handler returns (or right away if the connection is going
+ * away).
+ */
+static void gb_connection_recv_request_queue(struct gb_connection *connection,
+						struct gb_operation *operation)
+{
+	int ret;
+
+	ret = gb_operation_get_active(operation);
+	if (ret) {
+		gb_operation_put(operation);
+		return;
+	}
+	trace_gb_message_recv_request(operation->request);
+
+	if (gb_operation_result_set(operation, -EINPROGRESS))
+		gb_operation_request_queue(operation);
+}
+
+/*
+ * Messages are only fragmented on connections that negotiated messages
+ * larger than what the host device can transfer.  The MORE flag is
+ * ignored on all others.
+ */
+static bool gb_connection_fragmented(struct gb_connection *connection)
+{
+	return connection->message_size_max > connection->hd->buffer_size_max;
+}
+
+/*
+ * Look up an incoming request being reassembled, and take it off the
+ * connection's list of partial requests.
+ */
+static struct gb_operation *
+gb_operation_find_partial(struct gb_connection *connection, u16 operation_id)
+{
+	struct gb_operation *operation;
+	unsigned long flags;
+	bool found = false;
+
+	spin_lock_irqsave(&connection->lock, flags);
+	list_for_each_entry(operation, &connection->partial_requests, links)
+		if (operation->id == operation_id) {
+			list_del(&operation->links);
+			connection->partial_request_count--;
+			found = true;
+			break;
+		}
+	spin_unlock_irqrestore(&connection->lock, flags);
+
+	return found ? operation : NULL;
+}
+
+/*
+ * Make room in an incoming request being reassembled for @len more bytes
+ * of payload.  The total size of a fragmented request is not known in
+ * advance, so its buffer grows as fragments arrive.
+ */
+static int gb_message_fragment_grow(struct gb_connection *connection,
+					struct gb_message *message, size_t len)
+{
+	size_t payload_size = message->fragment_offset + len;
+	size_t message_size = sizeof(*message->header) + payload_size;
+	int ret;
+
+	if (message_size > connection->message_size_max)
+		return -EMSGSIZE;
+
+	ret = gb_message_buffer_resize(message, message_size, GFP_ATOMIC);
+	if (ret)
+		return ret;
+
+	message->header = message->buffer;
+	message->payload = message->header + 1;
+	message->payload_size = payload_size;
+
+	return 0;
+}
+
+/*
+ * Handle a fragment of an incoming request.  Fragmented requests are
+ * reassembled in an operation allocated outside the connection's request
+ * pool, which is kept on the connection's list of partial requests until
+ * its last fragment has arrived.  At most GB_OPERATION_PARTIAL_REQUESTS_MAX
+ * requests are reassembled at a time; the first fragment of any further
+ * request is dropped.
+ */
+static void gb_connection_recv_request_fragment(struct gb_connection *connection,
+				struct gb_operation *operation,
+				u16 operation_id, u8 type,
+				void *data, size_t size)
+{
+	bool first = !operation;
+	unsigned long flags;
+	int ret;
+
+	if (first) {
+		operation = gb_operation_create_common(connection, type, 0, 0,
+						GB_OPERATION_FLAG_INCOMING,
+						GFP_ATOMIC);
+		if (!operation) {
+			dev_err(&connection->dev, "can't create operation\n");
+			gb_connection_recv_request_nomem(connection,
+							operation_id, type);
+			return;
+		}
+		operation->id = operation_id;
+		if (!operation_id)
+			operation->flags |= GB_OPERATION_FLAG_UNIDIRECTIONAL;
+		trace_gb_operation_create(operation);
+	}
+
+	ret = gb_message_fragment_grow(connection, operation->request,
+				size - sizeof(struct gb_operation_msg_hdr));
+	if (!ret)
+		ret = gb_message_fragment_recv(operation->request, data, size);
+
+	if (ret == -EINPROGRESS) {
+		spin_lock_irqsave(&connection->lock, flags);
+		if (!first || connection->partial_request_count <
+					GB_OPERATION_PARTIAL_REQUESTS_MAX) {
+			list_add_tail(&operation->links,
+					&connection->partial_requests);
+			connection->partial_request_count++;
+		} else {
+			ret = -EBUSY;
+		}
+		spin_unlock_irqrestore(&connection->lock, flags);
+	}
+
+	switch (ret) {
+	case 0:
+		gb_connection_recv_request_queue(connection, operation);
+		break;
+	case -EINPROGRESS:
+		break;
+	default:
+		dev_err(&connection->dev,
+			"failed to reassemble request 0x%04x: %d\n",
+			operation_id, ret);
+		gb_operation_put(operation);
+		if (ret == -ENOMEM)
+			gb_connection_recv_request_nomem(connection,
+							operation_id, type);
+		break;
+	}
+}
+
+/*
+ * Drop the incoming requests whose reassembly has been interrupted by the
+ * connection being disabled.
+ */
+void gb_operation_partial_requests_discard(struct gb_connection *connection)
+{
+	struct gb_operation *operation;
+	struct gb_operation *next;
+	LIST_HEAD(list);
+
+	spin_lock_irq(&connection->lock);
+	list_splice_init(&connection->partial_requests, &list);
+	connection->partial_request_count = 0;
+	spin_unlock_irq(&connection->lock);
+
+	list_for_each_entry_safe(operation, next, &list, links) {
+		list_del(&operation->links);
+		gb_operation_put(operation);
+	}
+}
+
 /*
  * We've received data on a connection, and it doesn't look like a
  * response, so we assume it's a request.
  *
  * This is called in interrupt context, so just copy the incoming
- * data into the request buffer and handle the rest via workqueue.
+ * data into the request buffer (or adopt the loaned receive buffer)
+ * and handle the rest via workqueue.
+ *
+ * Returns true if a loaned buffer was adopted.
  */
-static void gb_connection_recv_request(struct gb_connection *connection,
+static bool gb_connection_recv_request(struct gb_connection *connection,
 				       u16 operation_id, u8 type,
-				       void *data, size_t size)
+				       void *data, size_t size, bool loan)
 {
+	struct gb_operation_msg_hdr *header = data;
 	struct gb_operation *operation;
-	int ret;
+	bool fragmented = gb_connection_fragmented(connection);
+	bool more = fragmented &&
+			header->pad[1] & GB_OPERATION_MSG_FLAG_MORE;
+
+	if (more || (fragmented &&
+			!list_empty(&connection->partial_requests))) {
+		operation = gb_operation_find_partial(connection, operation_id);
+		if (operation || more) {
+			gb_connection_recv_request_fragment(connection,
+						operation, operation_id, type,
+						data, size);
+			return false;
+		}
+	}
 
 	operation = gb_operation_create_incoming(connection, operation_id,
-						type, data, size);
+						type, data, size, loan);
 	if (!operation) {
 		dev_err(&connection->dev, "can't create operation\n");
-		return;		/* XXX Respond with pre-allocated ENOMEM */
+		gb_connection_recv_request_nomem(connection, operation_id,
+							type);
+		return false;
 	}
 
-	ret = gb_operation_get_active(operation);
-	if (ret) {
-		gb_operation_put(operation);
-		return;
-	}
-	trace_gb_message_recv_request(operation->request);
+	gb_connection_recv_request_queue(connection, operation);
 
-	/*
-	 * The initial reference to the operation will be dropped when the
-	 * request handler returns.
-	 */
-	if (gb_operation_result_set(operation, -EINPROGRESS))
-		queue_work(connection->wq, &operation->work);
+	return loan;
 }
 
 /*
@@ -852,23 +2005,53 @@ static void gb_connection_recv_request(struct gb_connection *connection,
  * its response.
  *
  * This is called in interrupt context, so just copy the incoming
- * data into the response buffer and handle the rest via workqueue.
+ * data into the response buffer (or adopt the loaned receive buffer)
+ * and handle the rest via workqueue.
+ *
+ * Returns true if a loaned buffer was adopted.
  */
-static void gb_connection_recv_response(struct gb_connection *connection,
-			u16 operation_id, u8 result, void *data, size_t size)
+static bool gb_connection_recv_response(struct gb_connection *connection,
+			u16 operation_id, u8 result, void *data, size_t size,
+			bool loan)
 {
+	struct gb_operation_msg_hdr *header = data;
 	struct gb_operation *operation;
 	struct gb_message *message;
 	int errno = gb_operation_status_map(result);
 	size_t message_size;
+	bool adopted = false;
+	int ret;
 
 	operation = gb_operation_find_outgoing(connection, operation_id);
 	if (!operation) {
+		gb_connection_stats_inc(connection, responses_unmatched);
 		dev_err(&connection->dev, "operation not found\n");
-		return;
+		return false;
 	}
+	gb_connection_stats_inc(connection, responses);
+	trace_gb_operation_response(operation);
 
 	message = operation->response;
+
+	/* Fragments are reassembled in the response buffer */
+	if (gb_connection_fragmented(connection) &&
+	    (header->pad[1] & GB_OPERATION_MSG_FLAG_MORE ||
+	     message->fragment_offset)) {
+		ret = gb_message_fragment_recv(message, data, size);
+		if (ret == -EINPROGRESS) {
+			gb_operation_put(operation);
+			return false;
+		}
+
+		if (ret) {
+			errno = ret;
+		} else {
+			data = message->header;
+			size = gb_message_size(message);
+		}
+		loan = false;
+	}
+
 	message_size = sizeof(*message->header) + message->payload_size;
 	if (!errno && size != message_size) {
 		dev_err(&connection->dev, "bad message (0x%02hhx) size (%zu != %zu)\n",
@@ -881,56 +2064,91 @@ static void gb_connection_recv_response(struct gb_connection *connection,
 	if (errno)
 		size = sizeof(*message->header);
 
-	/* The rest will be handled in work queue context */
+	/* The rest will be handled by the operation callback */
 	if (gb_operation_result_set(operation, errno)) {
-		memcpy(message->header, data, size);
-		queue_work(gb_operation_completion_wq, &operation->work);
+		gb_operation_latency_record(operation);
+		if (loan && !errno) {
+			gb_message_adopt(message, data);
+			adopted = true;
+		} else if (data != message->header) {
+			memcpy(message->header, data, size);
+		}
+		gb_operation_complete(operation);
 	}
 
 	gb_operation_put(operation);
+
+	return adopted;
 }
 
 /*
- * Handle data arriving on a connection.  As soon as we return the
- * supplied data buffer will be reused (so unless we do something
- * with, it's effectively dropped).
+ * Handle data arriving on a connection.
+ *
+ * If @loan is false, the supplied data buffer will be reused as soon as
+ * we return (so unless we do something with it, it's effectively
+ * dropped).
+ *
+ * If @loan is true, the host device offers us ownership of the buffer,
+ * which must be hd->buffer_size_max bytes in size.  Returns true if the
+ * buffer was adopted; it is then handed back through the host driver's
+ * buffer_free callback once the message using it is freed.
  */
-void gb_connection_recv(struct gb_connection *connection,
-				void *data, size_t size)
+static bool __gb_connection_recv(struct gb_connection *connection,
+				void *data, size_t size, bool loan)
 {
 	struct gb_operation_msg_hdr header;
 	size_t msg_size;
 	u16 operation_id;
 
+	gb_connection_stats_inc(connection, rx_messages);
+	gb_connection_stats_add(connection, rx_bytes, size);
+
 	if (connection->state != GB_CONNECTION_STATE_ENABLED) {
+		gb_connection_stats_inc(connection, rx_dropped);
 		dev_err(&connection->dev, "dropping %zu received bytes\n",
 			size);
-		return;
+		return false;
 	}
 
 	if (size < sizeof(header)) {
+		gb_connection_stats_inc(connection, rx_dropped);
 		dev_err(&connection->dev, "message too small\n");
-		return;
+		return false;
 	}
 
 	/* Use memcpy as data may be unaligned */
 	memcpy(&header, data, sizeof(header));
 	msg_size = le16_to_cpu(header.size);
 	if (size < msg_size) {
+		gb_connection_stats_inc(connection, rx_dropped);
 		dev_err(&connection->dev,
 			"incomplete message received for type 0x%02hhx: 0x%04x (%zu < %zu)\n",
 			header.type, le16_to_cpu(header.operation_id), size,
 			msg_size);
-		return;		/* XXX Should still complete operation */
+		return false;	/* XXX Should still complete operation */
 	}
 
 	operation_id = le16_to_cpu(header.operation_id);
 	if (header.type & GB_MESSAGE_TYPE_RESPONSE)
-		gb_connection_recv_response(connection, operation_id,
-						header.result, data, msg_size);
+		return gb_connection_recv_response(connection, operation_id,
+						header.result, data, msg_size,
+						loan);
 	else
-		gb_connection_recv_request(connection, operation_id,
-						header.type, data, msg_size);
+		return gb_connection_recv_request(connection, operation_id,
+						header.type, data, msg_size,
+						loan);
+}
+
+void gb_connection_recv(struct gb_connection *connection,
+				void *data, size_t size)
+{
+	__gb_connection_recv(connection, data, size, false);
+}
+
+bool gb_connection_recv_loan(struct gb_connection *connection,
+				void *data, size_t size)
+{
+	return __gb_connection_recv(connection, data, size, true);
 }
 
 /*
@@ -943,8 +2161,9 @@ void gb_operation_cancel(struct gb_operation *operation, int errno)
 		return;
 
 	if (gb_operation_result_set(operation, errno)) {
+		gb_connection_stats_inc(operation->connection, cancellations);
 		gb_message_cancel(operation->request);
-		queue_work(gb_operation_completion_wq, &operation->work);
+		gb_operation_complete(operation);
 	}
 	trace_gb_message_cancel_outgoing(operation->request);
 
@@ -970,8 +2189,12 @@ void gb_operation_cancel_incoming(struct gb_operation *operation, int errno)
 		 * before cancelling it.
 		 */
 		flush_work(&operation->work);
-		if (!gb_operation_result_set(operation, errno))
+		flush_work(&operation->connection->request_work);
+		if (!gb_operation_result_set(operation, errno)) {
+			gb_connection_stats_inc(operation->connection,
+						cancellations);
 			gb_message_cancel(operation->response);
+		}
 	}
 	trace_gb_message_cancel_incoming(operation->response);
 
@@ -1042,28 +2265,198 @@ int gb_operation_sync_timeout(struct gb_connection *connection, int type,
 }
 EXPORT_SYMBOL_GPL(gb_operation_sync_timeout);
 
+struct gb_operation_batch_waiter {
+	atomic_t		pending;
+	struct completion	completion;
+};
+
+/* Called in atomic context once per operation of the batch. */
+static void gb_operation_batch_callback(struct gb_operation *operation)
+{
+	struct gb_operation_batch_waiter *waiter = operation->private;
+
+	if (atomic_dec_and_test(&waiter->pending))
+		complete(&waiter->completion);
+}
+
+/**
+ * gb_operation_sync_batch_timeout: perform several synchronous operations
+ * @connection: the Greybus connection to send the requests to
+ * @batch: description of the operations to perform
+ * @count: number of entries in @batch
+ * @timeout: timeout of each operation in milliseconds
+ *
+ * This behaves like calling gb_operation_sync_timeout() for every entry of
+ * @batch, except that all requests are sent before waiting for any
+ * response, so the whole batch only costs about one round trip.  The
+ * requests are sent in order, but their responses may complete in any
+ * order.
+ *
+ * The result of each operation is stored in its batch entry.  Returns 0 if
+ * all operations succeeded, or the first error encountered otherwise.
+ */
+int gb_operation_sync_batch_timeout(struct gb_connection *connection,
+				struct gb_operation_batch *batch,
+				unsigned int count, unsigned int timeout)
+{
+	struct gb_operation_batch_waiter waiter;
+	struct gb_operation **operations;
+	struct gb_operation *operation;
+	struct gb_operation_batch *entry;
+	unsigned int i;
+	int ret = 0;
+
+	for (i = 0; i < count; i++) {
+		entry = &batch[i];
+		if ((entry->response_size && !entry->response) ||
+		    (entry->request_size && !entry->request))
+			return -EINVAL;
+	}
+
+	operations = kcalloc(count, sizeof(*operations), GFP_KERNEL);
+	if (!operations)
+		return -ENOMEM;
+
+	/* The initial count keeps the waiter from completing too early */
+	atomic_set(&waiter.pending, 1);
+	init_completion(&waiter.completion);
+
+	for (i = 0; i < count; i++) {
+		entry = &batch[i];
+
+		operation = gb_operation_create_flags(connection, entry->type,
+					entry->request_size,
+					entry->response_size,
+					GB_OPERATION_FLAG_ATOMIC_CALLBACK,
+					GFP_KERNEL);
+		if (!operation) {
+			entry->result = -ENOMEM;
+			continue;
+		}
+
+		if (entry->request_size)
+			memcpy(operation->request->payload, entry->request,
+			       entry->request_size);
+		operation->private = &waiter;
+
+		atomic_inc(&waiter.pending);
+		entry->result = gb_operation_request_send(operation,
+					gb_operation_batch_callback,
+					timeout, GFP_KERNEL);
+		if (entry->result) {
+			atomic_dec(&waiter.pending);
+			gb_operation_put(operation);
+			continue;
+		}
+
+		operations[i] = operation;
+	}
+
+	if (!atomic_dec_and_test(&waiter.pending)) {
+		if (wait_for_completion_interruptible(&waiter.completion)) {
+			/* Cancel whatever is left if interrupted */
+			for (i = 0; i < count; i++) {
+				if (operations[i])
+					gb_operation_cancel(operations[i],
+								-ECANCELED);
+			}
+		}
+	}
+
+	for (i = 0; i < count; i++) {
+		entry = &batch[i];
+		operation = operations[i];
+		if (operation) {
+			entry->result = gb_operation_result(operation);
+			if (!entry->result && entry->response_size) {
+				memcpy(entry->response,
+				       operation->response->payload,
+				       entry->response_size);
+			}
+			gb_operation_put(operation);
+		}
+
+		if (entry->result) {
+			dev_err(&connection->dev, "synchronous operation failed: 0x%02hhx (%d)\n",
+				entry->type, entry->result);
+			if (!ret)
+				ret = entry->result;
+		}
+	}
+
+	kfree(operations);
+
+	return ret;
+}
+EXPORT_SYMBOL_GPL(gb_operation_sync_batch_timeout);
+
+static void gb_message_buffer_caches_destroy(void)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(gb_message_buffer_caches); i++) {
+		kmem_cache_destroy(gb_message_buffer_caches[i]);
+		gb_message_buffer_caches[i] = NULL;
+	}
+}
+
+static int gb_message_buffer_caches_create(void)
+{
+	char name[32];
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(gb_message_buffer_caches); i++) {
+		snprintf(name, sizeof(name), "gb_message_buffer_%zu",
+			 gb_message_buffer_sizes[i]);
+		gb_message_buffer_caches[i] = kmem_cache_create(name,
+					gb_message_buffer_sizes[i],
+					ARCH_KMALLOC_MINALIGN, 0, NULL);
+		if (!gb_message_buffer_caches[i]) {
+			gb_message_buffer_caches_destroy();
+			return -ENOMEM;
+		}
+	}
+
+	return 0;
+}
+
 int __init gb_operation_init(void)
 {
 	gb_message_cache = kmem_cache_create("gb_message_cache",
-				sizeof(struct gb_message), 0, 0, NULL);
+				sizeof(struct gb_message),
+				ARCH_KMALLOC_MINALIGN, 0, NULL);
 	if (!gb_message_cache)
 		return -ENOMEM;
 
+	if (gb_message_buffer_caches_create())
+		goto err_destroy_message_cache;
+
 	gb_operation_cache = kmem_cache_create("gb_operation_cache",
-				sizeof(struct gb_operation), 0, 0, NULL);
+				sizeof(struct gb_operation), 0,
+				SLAB_HWCACHE_ALIGN, NULL);
 	if (!gb_operation_cache)
-		goto err_destroy_message_cache;
+		goto err_destroy_buffer_caches;
 
 	gb_operation_completion_wq = alloc_workqueue("greybus_completion",
 				0, 0);
 	if (!gb_operation_completion_wq)
 		goto err_destroy_operation_cache;
 
+	gb_operation_request_wq = alloc_workqueue("greybus_request",
+				WQ_UNBOUND, 0);
+	if (!gb_operation_request_wq)
+		goto err_destroy_completion_wq;
+
 	return 0;
 
+err_destroy_completion_wq:
+	destroy_workqueue(gb_operation_completion_wq);
+	gb_operation_completion_wq = NULL;
 err_destroy_operation_cache:
 	kmem_cache_destroy(gb_operation_cache);
 	gb_operation_cache = NULL;
+err_destroy_buffer_caches:
+	gb_message_buffer_caches_destroy();
 err_destroy_message_cache:
 	kmem_cache_destroy(gb_message_cache);
 	gb_message_cache = NULL;
@@ -1073,10 +2466,13 @@ err_destroy_message_cache:
 
 void gb_operation_exit(void)
 {
+	destroy_workqueue(gb_operation_request_wq);
+	gb_operation_request_wq = NULL;
 	destroy_workqueue(gb_operation_completion_wq);
 	gb_operation_completion_wq = NULL;
 	kmem_cache_destroy(gb_operation_cache);
 	gb_operation_cache = NULL;
+	gb_message_buffer_caches_destroy();
 	kmem_cache_destroy(gb_message_cache);
 	gb_message_cache = NULL;
 }
@@ -11,12 +11,56 @@
 #define __OPERATION_H
 
 #include <linux/completion.h>
+#include <linux/timer.h>
+#include <linux/scatterlist.h>
 
 struct gb_operation;
 
+/*
+ * Request to response latency is recorded, per connection, in per-CPU
+ * histograms of GB_OPERATION_LATENCY_BUCKETS log2 buckets of
+ * microseconds, for each operation type below GB_OPERATION_LATENCY_TYPES
+ * (the last histogram accounts for all larger types).
+ */
+#define GB_OPERATION_LATENCY_TYPES	16
+#define GB_OPERATION_LATENCY_BUCKETS	24
+
+struct gb_operation_latency {
+	u32	buckets[GB_OPERATION_LATENCY_TYPES][GB_OPERATION_LATENCY_BUCKETS];
+	u32	max[GB_OPERATION_LATENCY_TYPES];	/* microseconds */
+
+	/* Adaptive timeouts last derived on this CPU, and when */
+	unsigned int	timeout[GB_OPERATION_LATENCY_TYPES];	/* milliseconds */
+	unsigned long	timeout_jiffies[GB_OPERATION_LATENCY_TYPES];
+};
+
 /* The default amount of time a request is given to complete */
 #define GB_OPERATION_TIMEOUT_DEFAULT	1000	/* milliseconds */
 
+/*
+ * Requests sent with an adaptive timeout are given GB_OPERATION_TIMEOUT_P99
+ * times the 99th percentile of the latency observed for their type on their
+ * connection, once GB_OPERATION_TIMEOUT_SAMPLES responses or timeouts have
+ * been seen, and GB_OPERATION_TIMEOUT_DEFAULT before.  The result is bounded
+ * by the connection's timeout_min and timeout_max, and derived again at
+ * most every GB_OPERATION_TIMEOUT_REFRESH milliseconds.
+ *
+ * Callers opt in by passing GB_OPERATION_TIMEOUT_ADAPTIVE as timeout.  It
+ * only suits operation types whose latency does not depend on their payload.
+ */
+#define GB_OPERATION_TIMEOUT_ADAPTIVE	UINT_MAX
+#define GB_OPERATION_TIMEOUT_P99	4
+#define GB_OPERATION_TIMEOUT_SAMPLES	32
+#define GB_OPERATION_TIMEOUT_REFRESH	250	/* milliseconds */
+#define GB_OPERATION_TIMEOUT_MIN_DEFAULT	20	/* milliseconds */
+#define GB_OPERATION_TIMEOUT_MAX_DEFAULT	5000	/* milliseconds */
+
+/* The default number of incoming operations reserved per connection */
+#define GB_OPERATION_REQUEST_POOL_DEFAULT	2
+
+/* The most incoming requests a connection reassembles at a time */
+#define GB_OPERATION_PARTIAL_REQUESTS_MAX	4
+
 /*
  * No protocol may define an operation that has numeric value 0x00.
  * It is reserved as an explicitly invalid value.
@@ -46,10 +90,32 @@ enum gb_operation_result {
 #define GB_OPERATION_MESSAGE_SIZE_MIN	sizeof(struct gb_operation_msg_hdr)
 #define GB_OPERATION_MESSAGE_SIZE_MAX	U16_MAX
 
+/* Messages up to this size (header included) are stored in the gb_message */
+#define GB_MESSAGE_INLINE_SIZE		64
+
 /*
  * Protocol code should only examine the payload and payload_size fields, and
  * host-controller drivers may use the hcpriv field. All other fields are
  * intended to be private to the operations core code.
+ *
+ * Small messages are stored in the message's inline buffer; larger ones in
+ * a buffer allocated from a size-class cache (buffer_cache), or kmalloc()ed
+ * when they exceed the largest class.  Outbound messages use a buffer
+ * provided by the host device instead (buffer_hd) when its driver offers
+ * one, e.g. already set up for DMA, unless they are described by a
+ * scatter-gather list, which needs a linearly mapped buffer.
+ *
+ * The header normally points to the start of the message's own buffer.  For
+ * received messages it may instead point into a buffer loaned by the host
+ * device, which is returned to it when the message is freed.
+ *
+ * If sg is set, the message is described by a scatter-gather list of num_sgs
+ * entries: the first covers the header and payload, the others data that is
+ * sent after the payload without being copied into the message buffer.
+ *
+ * Messages larger than the host device buffers are sent as a sequence of
+ * fragments (see struct gb_operation_msg_hdr), using a separate fragment
+ * message; fragment_offset tracks the payload sent or received so far.
  */
 struct gb_message {
 	struct gb_operation		*operation;
@@ -58,13 +124,39 @@ struct gb_message {
 	void				*payload;
 	size_t				payload_size;
 
+	void				*hcpriv;
+
 	void				*buffer;
+	struct kmem_cache		*buffer_cache;
+	struct greybus_host_device	*buffer_hd;
 
-	void				*hcpriv;
+	struct scatterlist		*sg;
+	unsigned int			num_sgs;
+
+	struct gb_message		*fragment;
+	size_t				fragment_offset;
+
+	u8				inline_buffer[GB_MESSAGE_INLINE_SIZE]
+						__aligned(ARCH_KMALLOC_MINALIGN);
 };
 
+/*
+ * Total size of an outbound message, including any data described by the
+ * message's scatter-gather list.
+ */
+static inline size_t gb_message_size(struct gb_message *message)
+{
+	return le16_to_cpu(message->header->size);
+}
+
 #define GB_OPERATION_FLAG_INCOMING		BIT(0)
 #define GB_OPERATION_FLAG_UNIDIRECTIONAL	BIT(1)
+#define GB_OPERATION_FLAG_POOLED		BIT(2)
+#define GB_OPERATION_FLAG_ATOMIC_CALLBACK	BIT(3)
+#define GB_OPERATION_FLAG_SG			BIT(4)
+#define GB_OPERATION_FLAG_TIMED_OUT		BIT(5)
+
+#define GB_OPERATION_FLAG_USER_MASK	GB_OPERATION_FLAG_ATOMIC_CALLBACK
 
 /*
  * A Greybus operation is a remote procedure call performed over a
@@ -84,27 +176,40 @@ struct gb_message {
  * In addition, every operation has a result, which is an errno
  * value.  Protocol handlers access the operation result using
  * gb_operation_result().
+ *
+ * The fields used to match an incoming response to its operation, take a
+ * reference to it and record its result and latency come first, and fill
+ * the first 64 bytes of the (cache-aligned) operation on 64-bit builds.
+ * Keep them together when adding fields.  The fields used to complete the
+ * operation follow, and those only used when it is created or queued come
+ * last.
  */
 typedef void (*gb_operation_callback)(struct gb_operation *);
 struct gb_operation {
+	/* Response matching */
+	struct hlist_node	hash_link;	/* connection->outgoing_operations */
 	struct gb_connection	*connection;
-	struct gb_message	*request;
 	struct gb_message	*response;
-
 	unsigned long		flags;
+	ktime_t			start;		/* When the request was sent */
 	u8			type;
 	u16			id;
 	int			errno;		/* Operation result */
+	struct kref		kref;
+	int			active;
 
-	struct work_struct	work;
+	/* Completion */
+	struct gb_message	*request;
+	struct list_head	links;		/* connection->operations */
+	struct timer_list	timer;		/* Response timeout */
 	gb_operation_callback	callback;
+	struct work_struct	work;
 	struct completion	completion;
-
-	struct kref		kref;
 	atomic_t		waiters;
 
-	int			active;
-	struct list_head	links;		/* connection->operations */
+	ktime_t			created;
+	void			*private;	/* For the callback's use */
+	struct list_head	queue_link;	/* connection->request_queue */
 };
 
 static inline bool
@@ -119,16 +224,41 @@ gb_operation_is_unidirectional(struct gb_operation *operation)
 	return operation->flags & GB_OPERATION_FLAG_UNIDIRECTIONAL;
 }
 
+static inline bool
+gb_operation_has_atomic_callback(struct gb_operation *operation)
+{
+	return operation->flags & GB_OPERATION_FLAG_ATOMIC_CALLBACK;
+}
+
 void gb_connection_recv(struct gb_connection *connection,
 					void *data, size_t size);
+bool gb_connection_recv_loan(struct gb_connection *connection,
+					void *data, size_t size);
 
 int gb_operation_result(struct gb_operation *operation);
 
 size_t gb_operation_get_payload_size_max(struct gb_connection *connection);
-struct gb_operation *gb_operation_create(struct gb_connection *connection,
-					u8 type, size_t request_size,
-					size_t response_size,
-					gfp_t gfp);
+struct gb_operation *
+gb_operation_create_flags(struct gb_connection *connection,
+				u8 type, size_t request_size,
+				size_t response_size, unsigned long flags,
+				gfp_t gfp);
+
+static inline struct gb_operation *
+gb_operation_create(struct gb_connection *connection,
+				u8 type, size_t request_size,
+				size_t response_size, gfp_t gfp)
+{
+	return gb_operation_create_flags(connection, type, request_size,
+						response_size, 0, gfp);
+}
+
+struct gb_operation *
+gb_operation_create_sg(struct gb_connection *connection, u8 type,
+				size_t request_size, size_t response_size,
+				struct scatterlist *sg, unsigned int nents,
+				off_t skip, size_t sg_size, gfp_t gfp);
+
 void gb_operation_get(struct gb_operation *operation);
 void gb_operation_put(struct gb_operation *operation);
 
@@ -137,6 +267,7 @@ bool gb_operation_response_alloc(struct gb_operation *operation,
 
 int gb_operation_request_send(struct gb_operation *operation,
 				gb_operation_callback callback,
+				unsigned int timeout,
 				gfp_t gfp);
 int gb_operation_request_send_sync_timeout(struct gb_operation *operation,
 						unsigned int timeout);
@@ -167,6 +298,42 @@ static inline int gb_operation_sync(struct gb_connection *connection, int type,
 			GB_OPERATION_TIMEOUT_DEFAULT);
 }
 
+/*
+ * One request of a batch of synchronous operations.  The result of the
+ * operation is stored in @result; the response is only copied back to
+ * @response if it is 0.
+ */
+struct gb_operation_batch {
+	int		type;
+	void		*request;
+	int		request_size;
+	void		*response;
+	int		response_size;
+	int		result;
+};
+
+int gb_operation_sync_batch_timeout(struct gb_connection *connection,
+				struct gb_operation_batch *batch,
+				unsigned int count, unsigned int timeout);
+
+static inline int
+gb_operation_sync_batch(struct gb_connection *connection,
+			struct gb_operation_batch *batch, unsigned int count)
+{
+	return gb_operation_sync_batch_timeout(connection, batch, count,
+			GB_OPERATION_TIMEOUT_DEFAULT);
+}
+
+void gb_operation_request_work(struct work_struct *work);
+
+unsigned int gb_operation_latency_percentile(u32 *buckets, u64 count,
+					     unsigned int percent);
+
+void gb_operation_partial_requests_discard(struct gb_connection *connection);
+
+int gb_operation_request_pool_create(struct gb_connection *connection);
+void gb_operation_request_pool_destroy(struct gb_connection *connection);
+
 int gb_operation_init(void);
 void gb_operation_exit(void);
 
@@ -19,6 +19,8 @@ struct gb_operation;
 #define GB_PROTOCOL_NO_BUNDLE			BIT(2)	/* Protocol May have a bundle-less connection */
 #define GB_PROTOCOL_SKIP_VERSION		BIT(3)	/* Don't send get_version() requests */
 #define GB_PROTOCOL_SKIP_SVC_CONNECTION		BIT(4)	/* Don't send SVC connection requests */
+#define GB_PROTOCOL_FRAGMENTATION		BIT(5)	/* Negotiate message fragmentation */
+#define GB_PROTOCOL_CONCURRENT_REQUESTS		BIT(6)	/* request_recv() is reentrant */
 
 typedef int (*gb_connection_init_t)(struct gb_connection *);
 typedef void (*gb_connection_exit_t)(struct gb_connection *);
@@ -35,6 +37,7 @@ struct gb_protocol {
 	u8			minor;
 	u8			count;
 	unsigned long		flags;
+	unsigned int		request_pool_size;	/* 0 means default */
 
 	struct list_head	links;		/* global list */
 
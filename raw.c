@@ -127,24 +127,29 @@ static int gb_raw_send(struct gb_raw *raw, u32 len, const char __user *data)
 {
 	struct gb_connection *connection = raw->connection;
 	struct gb_raw_send_request *request;
+	struct gb_operation *operation;
 	int retval;
 
-	request = kmalloc(len + sizeof(*request), GFP_KERNEL);
-	if (!request)
+	operation = gb_operation_create(connection, GB_RAW_TYPE_SEND,
+					len + sizeof(*request), 0, GFP_KERNEL);
+	if (!operation)
 		return -ENOMEM;
 
+	/* Copy the user data straight into the request message */
+	request = operation->request->payload;
 	if (copy_from_user(&request->data[0], data, len)) {
-		kfree(request);
-		return -EFAULT;
+		retval = -EFAULT;
+		goto exit;
 	}
 
 	request->len = cpu_to_le32(len);
 
-	retval = gb_operation_sync(connection, GB_RAW_TYPE_SEND,
-				   request, len + sizeof(*request),
-				   NULL, 0);
-
-	kfree(request);
+	retval = gb_operation_request_send_sync(operation);
+	if (retval)
+		dev_err(&connection->dev, "synchronous operation failed: 0x%02hhx (%d)\n",
+			GB_RAW_TYPE_SEND, retval);
+exit:
+	gb_operation_put(operation);
 	return retval;
 }
 
@@ -224,6 +229,7 @@ static struct gb_protocol raw_protocol = {
 	.connection_init	= gb_raw_connection_init,
 	.connection_exit	= gb_raw_connection_exit,
 	.request_recv		= gb_raw_receive,
+	.request_pool_size	= 8,
 };
 
 /*
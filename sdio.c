@@ -215,41 +215,45 @@ static int _gb_sdio_send(struct gb_sdio_host *host, struct mmc_data *data,
 			 size_t len, u16 nblocks, off_t skip)
 {
 	struct gb_sdio_transfer_request *request;
-	struct gb_sdio_transfer_response response;
-	struct scatterlist *sg = data->sg;
-	unsigned int sg_len = data->sg_len;
-	size_t copied;
+	struct gb_sdio_transfer_response *response;
+	struct gb_operation *operation;
 	u16 send_blksz;
 	u16 send_blocks;
 	int ret;
 
 	WARN_ON(len > host->data_max);
 
-	request = host->xfer_buffer;
+	/* The data is sent straight from the request scatterlist if possible */
+	operation = gb_operation_create_sg(host->connection,
+					   GB_SDIO_TYPE_TRANSFER,
+					   sizeof(*request), sizeof(*response),
+					   data->sg, data->sg_len, skip, len,
+					   GFP_KERNEL);
+	if (!operation)
+		return -ENOMEM;
+
+	request = operation->request->payload;
 	request->data_flags = (data->flags >> 8);
 	request->data_blocks = cpu_to_le16(nblocks);
 	request->data_blksz = cpu_to_le16(data->blksz);
 
-	copied = sg_pcopy_to_buffer(sg, sg_len, &request->data[0], len, skip);
-
-	if (copied != len)
-		return -EINVAL;
-
-	ret = gb_operation_sync(host->connection, GB_SDIO_TYPE_TRANSFER,
-				request, len + sizeof(*request),
-				&response, sizeof(response));
+	ret = gb_operation_request_send_sync(operation);
 	if (ret < 0)
-		return ret;
+		goto out_put;
 
-	send_blocks = le16_to_cpu(response.data_blocks);
-	send_blksz = le16_to_cpu(response.data_blksz);
+	response = operation->response->payload;
+	send_blocks = le16_to_cpu(response->data_blocks);
+	send_blksz = le16_to_cpu(response->data_blksz);
 
 	if (len != send_blksz * send_blocks) {
 		dev_err(mmc_dev(host->mmc), "send: size received: %zu != %d\n",
 			len, send_blksz * send_blocks);
-		return -EINVAL;
+		ret = -EINVAL;
 	}
 
+out_put:
+	gb_operation_put(operation);
+
 	return ret;
 }
 
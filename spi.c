@@ -187,96 +187,52 @@ static void gb_spi_cleanup(struct spi_device *spi)
 #define gb_spi_mode_map(mode) mode
 #define gb_spi_flags_map(flags) flags
 
-static int gb_spi_mode_operation(struct gb_spi *spi)
-{
-	struct gb_spi_mode_response response;
-	u16 mode;
-	int ret;
-
-	ret = gb_operation_sync(spi->connection, GB_SPI_TYPE_MODE,
-				NULL, 0, &response, sizeof(response));
-	if (ret)
-		return ret;
-
-	mode = le16_to_cpu(response.mode);
-	spi->mode = gb_spi_mode_map(mode);
-
-	return 0;
-}
-
-static int gb_spi_flags_operation(struct gb_spi *spi)
-{
-	struct gb_spi_flags_response response;
-	u16 flags;
-	int ret;
-
-	ret = gb_operation_sync(spi->connection, GB_SPI_TYPE_FLAGS,
-				NULL, 0, &response, sizeof(response));
-	if (ret)
-		return ret;
-
-	flags = le16_to_cpu(response.flags);
-	spi->flags = gb_spi_flags_map(flags);
-
-	return 0;
-}
-
-static int gb_spi_bpw_operation(struct gb_spi *spi)
-{
-	struct gb_spi_bpw_response response;
-	int ret;
-
-	ret = gb_operation_sync(spi->connection, GB_SPI_TYPE_BITS_PER_WORD_MASK,
-				NULL, 0, &response, sizeof(response));
-	if (ret)
-		return ret;
-
-	spi->bits_per_word_mask = le32_to_cpu(response.bits_per_word_mask);
-
-	return 0;
-}
-
-static int gb_spi_chipselect_operation(struct gb_spi *spi)
-{
-	struct gb_spi_chipselect_response response;
-	int ret;
-
-	ret = gb_operation_sync(spi->connection, GB_SPI_TYPE_NUM_CHIPSELECT,
-				NULL, 0, &response, sizeof(response));
-	if (ret)
-		return ret;
-
-	spi->num_chipselect = le16_to_cpu(response.num_chipselect);
-
-	return 0;
-}
-
 /*
  * Initialize the spi device. This includes verifying we can support it (based
  * on the protocol version it advertises). If that's OK, we get and cached its
  * mode bits & flags.
+ *
+ * None of these ever change, so they are all fetched once, in a single batch
+ * of operations.
  */
 static int gb_spi_init(struct gb_spi *spi)
 {
+	struct gb_spi_mode_response mode;
+	struct gb_spi_flags_response flags;
+	struct gb_spi_chipselect_response chipselect;
+	struct gb_spi_bpw_response bpw;
+	struct gb_operation_batch batch[] = {
+		{
+			.type		= GB_SPI_TYPE_MODE,
+			.response	= &mode,
+			.response_size	= sizeof(mode),
+		}, {
+			.type		= GB_SPI_TYPE_FLAGS,
+			.response	= &flags,
+			.response_size	= sizeof(flags),
+		}, {
+			.type		= GB_SPI_TYPE_NUM_CHIPSELECT,
+			.response	= &chipselect,
+			.response_size	= sizeof(chipselect),
+		}, {
+			.type		= GB_SPI_TYPE_BITS_PER_WORD_MASK,
+			.response	= &bpw,
+			.response_size	= sizeof(bpw),
+		},
+	};
 	int ret;
 
-	/* mode never changes, just get it once */
-	ret = gb_spi_mode_operation(spi);
+	ret = gb_operation_sync_batch(spi->connection, batch,
+				      ARRAY_SIZE(batch));
 	if (ret)
 		return ret;
 
-	/* flags never changes, just get it once */
-	ret = gb_spi_flags_operation(spi);
-	if (ret)
-		return ret;
+	spi->mode = gb_spi_mode_map(le16_to_cpu(mode.mode));
+	spi->flags = gb_spi_flags_map(le16_to_cpu(flags.flags));
+	spi->num_chipselect = le16_to_cpu(chipselect.num_chipselect);
+	spi->bits_per_word_mask = le32_to_cpu(bpw.bits_per_word_mask);
 
-	/* total number of chipselects never changes, just get it once */
-	ret = gb_spi_chipselect_operation(spi);
-	if (ret)
-		return ret;
-
-	/* bits-per-word-mask never changes, just get it once */
-	return gb_spi_bpw_operation(spi);
+	return 0;
 }
 
 static int gb_spi_connection_init(struct gb_connection *connection)